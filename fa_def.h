@@ -28,8 +28,8 @@
 #define	FA_WRITE	0x00000800
 #define	FA_UPDATE	0x00001000
 #define	FA_DELETE	0x00002000
-//	spare		0x00004000
-//	spare		0x00008000
+#define	FA_EXPORT	0x00004000		// Bulk transfer of a whole table to a file
+#define	FA_IMPORT	0x00008000		//	and back again
 
 #define	FA_PREPARE	0x00010000		// Common SQL actions
 #define	FA_STEP		0x00020000
@@ -37,7 +37,7 @@
 #define	FA_EXEC		0x00080000
 #define	FA_INIT		0x00100000
 #define	FA_DISTINCT	0x00200000
-//	spare		0x00400000
+#define	FA_BATCH	0x00400000		// With FA_READ, look up a batch of keys in one SELECT
 //	spare		0x00800000
 
 #define	FA_LINK		0x01000000		// Filehandler defined actions
@@ -45,7 +45,7 @@
 #define	FA_ADD		0x04000000
 #define	FA_COUNT	0x08000000
 #define	FA_RESET	0x10000000
-//	spare		0x20000000
+#define	FA_BINARY	0x20000000		// Use a binary file format rather than text
 //	spare		0x40000000
 //	spare		0x80000000
 
@@ -10,14 +10,22 @@
 //		FA_OPEN		- Open Database
 //		FA_CLOSE	- Close Database
 //		FA_READ		- Prepare a SELECT command. Can be used with FA_STEP to return the result of the 1st STEP
+//						tables with selected fields are LEFT JOINed into the one SELECT using their JOIN conditions
+//					with FA_BATCH, SQL points to a struct fa_sql_batch of keys to look up in one SELECT. Each
+//						FA_STEP sets its iMatch to the index of the key the row matched
 //		FA_WRITE	- Prepare an INSERT command to add a row to the database
+//						or use the table's specialised INSERT function if generated by fa_schema_gen
 //		FA_UPDATE	- Prepare an UPDATE command to update selected fields in the database
+//						or with FA_WRITE, INSERT a row or UPDATE it if its primary key already exists
 //		FA_PREPARE	- An adhoc query so pass the SQL instruction on to the sql_handler
 //		FA_STEP		- Return the next row of data from an FA_READ
 //		FA_RESET	- Reset a prepared statement, ready for stepping through again
 //		FA_FINALISE	- Tidily close a SELECT-STEP-FINALISE loop - other commands will also trigger this
 //		FA_EXEC		- Pass on a passed SQL instruction for execution in a single SELECT-STEP-FINALISE action
 //		FA_DELETE	- Prepare a DELETE command to remove a row from the database
+//		FA_EXPORT	- Stream every row of a table out to the file named by SQL - CSV unless FA_BINARY
+//		FA_IMPORT	- Stream every row in the file named by SQL into a table - CSV unless FA_BINARY
+//		FA_INIT		- Initialise libgxtfa. If SQL names a file then capture a trace of all calls to it, see fa_trace
 //
 //	GNU GPLv3 licence	libgxtfa by Andrew Bennington 2016 [www.benningtons.net]
 //
@@ -25,43 +33,85 @@
 
 #include <stdio.h>			// standard I/O
 #include <string.h>			// string functions such as strncmp
+#include <time.h>			// clock_gettime for workload traces
 
 #include <fa_def.h>			// file/db actions
 #include <fa_lun.h>			// table of file, database and prepared command handles
 #include <fa_sql_def.h>		// format for holding details of any SQL database to enable unpacking of data
+#include <fa_trace.h>		// workload trace capture
 #include <ut_error.h>		// error handling and debug functions
 
 
 int fa_handler(int iAction, struct fa_sql_db *spDB, char *cpSQL)
 {
+	struct fa_sql_table *spTab = 0;	// 1st table with selected fields - as used by the SQL generator
 	char sBuff[FA_BUFFER_S0];		// SQL command input buffer	#TODO - use malloc and a common SQL size
 	char *cp = &sBuff[0];
 	int i;
 	int ios = 0;
+	int iTraceAction = iAction;		// details to record if capturing a workload trace
+	int iTraceLun = -1;
+	char *cpTrace = 0;
+	char *cpBound = 0;				// a specialised INSERT with its bound values, or a batched read with
+									//	its key load, for the workload trace
+	struct timespec sStart;
 
 
 	ut_debug("action:%x", iAction);
 
+	if (fa_trace_fp != 0)								// capturing a workload trace?
+	 {
+		clock_gettime(CLOCK_MONOTONIC, &sStart);
+		if (!(iAction & (FA_INIT+FA_OPEN))) iTraceLun=spDB->iLun;
+	 }
+
+	if (iAction & (FA_WRITE+FA_READ))					// look for any specialised functions to use
+		for (i=0; i < spDB->iTab && spTab == 0; i++)
+			if (spDB->spTab[i].bmField != 0) spTab=&spDB->spTab[i];
+
 	if (iAction & (FA_PREPARE+FA_EXEC))					// Use the passed SQL script for adhoc actions
 		cp=cpSQL;
+	else if ((iAction & (FA_WRITE+FA_READ+FA_UPDATE)) == FA_WRITE &&
+			spTab != 0 && spTab->fpWrite != 0)			// fa_schema_gen'd INSERT so no need to generate SQL
+		iAction=FA_WRITE;
 	else if (iAction & (FA_WRITE+FA_READ+FA_UPDATE+FA_DELETE))	// generate an SQL script from the details passed
 	 {
-		ut_check(fa_sql_generator(	iAction,			// Pass on the action
-									spDB,				// Database definition
-									cpSQL,				// pass any SQL script fed into the filehandler
-									cp) == 0,			// pointer to output buffer for generated scipt
-				"SQL gen fail");						// will jump to error: if a problem
+		if (iAction & FA_READ && iAction & FA_BATCH && cpSQL == 0)
+			ios=-1;										// needs the keys to look up
+		ut_check(ios != -1, "no batch");
+		ios=fa_sql_generator(	iAction,				// Pass on the action
+								spDB,					// Database definition
+								cpSQL,					// pass any SQL script fed into the filehandler
+								cp);					// pointer to output buffer for generated scipt
+		ut_check(ios == 0, "SQL gen fail");				// will jump to error: if a problem e.g. SQL too long
 		cp=&sBuff[0];									// point back to the start ready for passing
 		if (!(iAction & FA_READ)) iAction=FA_EXEC;		// SQL script is prepared so now execute it
+		else if (iAction & FA_BATCH)					// load the keys for the SELECT to JOIN to
+		  {
+			ios=fa_sql_handler(FA_BATCH, cpSQL, spDB);
+			ut_check(ios == 0, "batch fail");
+		  }
+	 }
+	else if (iAction & (FA_EXPORT+FA_IMPORT))			// bulk transfer between a table and a file
+	 {
+		cpTrace=cpSQL;
+		ios=fa_sql_bulk(iAction,						// Pass on the action
+						cpSQL,							// file name
+						spDB);							// Database definition
+		ut_check(ios == 0, "bulk %d", ios);
 	 }
 	else if (iAction & FA_INIT)							//intitalise libgxtfa when starting a process
+	 {
 		for (i=0; i < FA_LUN_M0; i++)
 		  {
 			fa_lun[i].sFile[0]=0;
 			fa_lun[i].db=0;
 		  }
+		if (cpSQL != 0)									// start capturing a workload trace?
+			ut_check(fa_trace(FA_OPEN, cpSQL) == 0, "trace fail");
+	 }
 
-	if (iAction & (FA_PREPARE+FA_FINALISE+FA_EXEC+
+	if (iAction & (FA_PREPARE+FA_FINALISE+FA_EXEC+FA_WRITE+
 					FA_RESET+FA_READ+FA_OPEN+FA_CLOSE))	// Pass these SQL commands straight through
 	 {
 		if (iAction & FA_OPEN)						// Allocate a lun slot for db and transaction handles
@@ -73,6 +123,7 @@ int fa_handler(int iAction, struct fa_sql_db *spDB, char *cpSQL)
 						"%s%s",
 						spDB->sPath,				// path name
 						spDB->sFile);				// file name
+			cpTrace=sBuff;
 
 			for (i=0; i < FA_LUN_M0; i++)		// need to check through all to ensure not already open
 			 {
@@ -96,11 +147,19 @@ int fa_handler(int iAction, struct fa_sql_db *spDB, char *cpSQL)
 		else
 			i=iAction;
 
-		if (i & (FA_PREPARE+FA_EXEC)) ut_debug("SQL=%s", cp);	// check on prepared SQL scripts
+		if (i & (FA_PREPARE+FA_EXEC))
+		 {
+			ut_debug("SQL=%s", cp);					// check on prepared SQL scripts
+			cpTrace=cp;
+		 }
 
 		ios=fa_sql_handler(	i,						// Pass on the action
 							cp,						// SQL command
 							spDB);					// Database definition
+		if (i == FA_WRITE && fa_trace_fp != 0)		// trace the INSERT as run, with its bound values
+			cpTrace=cpBound=sqlite3_expanded_sql(fa_lun[spDB->iLun].spWrite);
+		else if (iAction & FA_READ && iAction & FA_BATCH && fa_trace_fp != 0)	// and the keys a batch JOINs to
+			cpTrace=cpBound=fa_trace_batch((struct fa_sql_batch *) cpSQL, cp);
 		ut_check (ios == 0,"%d", ios);				// jumps to error: if not true
 
 		if (iAction & FA_CLOSE)						// Closed file/db so release lun
@@ -109,6 +168,18 @@ int fa_handler(int iAction, struct fa_sql_db *spDB, char *cpSQL)
 			fa_lun[spDB->iLun].db=0;				// drop db handle
 			spDB->iLun=0;							// clear lun in db definitions
 		 }
+		else if (i & FA_PREPARE)					// Can rows be unpacked by a specialised function?
+		 {
+			fa_lun[spDB->iLun].spUnpack=0;
+			fa_lun[spDB->iLun].spBatch=(iAction & FA_READ && iAction & FA_BATCH) ? (struct fa_sql_batch *) cpSQL : 0;
+			if (iAction & FA_READ && !(iAction & (FA_COUNT+FA_BATCH)) && spTab != 0 && spTab->fpUnpack != 0)
+			 {
+				fa_lun[spDB->iLun].spUnpack=spTab;
+				fa_lun[spDB->iLun].bmUnpack=spTab->bmField;
+				for (i=spTab-spDB->spTab+1; i < spDB->iTab; i++)	// but not if JOINed to other tables
+					if (spDB->spTab[i].bmField != 0) fa_lun[spDB->iLun].spUnpack=0;
+			 }
+		 }
 		else if (iAction & FA_OPEN)
 		 {
 			snprintf(	fa_lun[spDB->iLun].sFile,
@@ -118,7 +189,7 @@ int fa_handler(int iAction, struct fa_sql_db *spDB, char *cpSQL)
 		 }
 	 }
 	else
-		ut_check((iAction & (FA_STEP+FA_INIT)), "unknown: %d", iAction);		// Valid action passed?
+		ut_check((iAction & (FA_STEP+FA_INIT+FA_EXPORT+FA_IMPORT)), "unknown: %d", iAction);	// Valid action passed?
 
 
 	if (iAction & FA_STEP)							// Step through rows from a previously prepared SELECT
@@ -134,5 +205,11 @@ int fa_handler(int iAction, struct fa_sql_db *spDB, char *cpSQL)
 	 }
 
 error:
+	if (fa_trace_fp != 0 && !(iTraceAction & FA_INIT))	// record call in any workload trace
+	 {
+		if (iTraceAction & FA_OPEN) iTraceLun=spDB->iLun;
+		fa_trace_record(iTraceAction, iTraceLun, ios, cpTrace, &sStart);
+		sqlite3_free(cpBound);
+	 }
 	return ios;
 }
@@ -20,6 +20,16 @@ struct
 	char sFile[FA_FULLNAME_S0];
 	sqlite3 *db;
 	sqlite3_stmt *row;
+	struct fa_sql_table *spUnpack;		// table with a specialised unpacker for the prepared statement or 0
+	int bmUnpack;						// columns selected from that table when prepared
+	sqlite3_stmt *spWrite;				// INSERT re-used for a table's specialised FA_WRITEs or 0
+	struct fa_sql_table *spWriteTab;	//	the table it INSERTs into
+	int bmWrite;						//	and the columns it INSERTs
+	struct fa_sql_batch *spBatch;		// batched lookup being stepped through, to mark rows with their key, or 0
+	int iBusyMs;						// ms to wait on a locked database
+	int iBusyRetry;						// statement retries once the busy wait has expired
+	int iBusyWaited;					// ms waited so far on the current lock
+	long long lActive;					// monotonic us of the last call, for the checkpoint scheduler's idle test
   } fa_lun[FA_LUN_M0];
 
 // #TODO should prepare statements at start-up and re-use them with sqlite3_bind and reset.
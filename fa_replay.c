@@ -0,0 +1,359 @@
+//--------------------------------------------------------------
+//
+// Replay a workload trace captured by fa_trace against a copy of the database(s) and report performance
+//
+//	usage:	fa_replay [-c] [-t] trace database [database...]
+//		where	-c replays at the original concurrency, one thread per traced thread, rather than single-threaded
+//				-t keeps the original timing between calls rather than replaying as fast as possible
+//				trace is a trace file written by fa_trace
+//				database is a copy of the database to replay against. Traces opening several databases need
+//					a copy for each, in the order they were first opened. Luns already open when the trace
+//					started use the 1st database.
+//		returns 0 if ok, else 1
+//
+// Each thread replays its calls using its own database connections. Calls are re-executed from the SQL
+//	scripts recorded in the trace, so the replay does not need the calling program's database definitions.
+//	Any statements before the last of a prepared script, such as a batched read's key load, are run first.
+//	Bulk FA_EXPORT/FA_IMPORT calls are skipped. Reports throughput and latency percentiles of the replay
+//	next to those of the original traced calls.
+//
+//	GNU GPLv3 licence	libgxtfa by Andrew Bennington 2017 [www.benningtons.net]
+//
+//--------------------------------------------------------------
+
+#include <ctype.h>			// isspace
+#include <pthread.h>		// replay threads
+#include <sqlite3.h>		// used for database application interface calls
+#include <stdio.h>			// standard I/O
+#include <stdlib.h>			// memory allocation and qsort
+#include <string.h>			// string functions such as strcmp
+#include <time.h>			// clock_gettime for timings
+#include <unistd.h>			// getopt
+
+#include <fa_def.h>			// file/db actions
+#include <fa_lun.h>			// FA_LUN_M0 - max number of luns traced
+#include <fa_trace.h>		// trace file format
+
+#define	FA_REPLAY_FILE_M0	10			// Limits number of databases in a trace
+#define	FA_REPLAY_THREAD_M0	100			// Limits number of threads in a trace
+#define	FA_REPLAY_BUSY_IV0	5000		// ms to wait on a locked database
+
+
+struct fa_replay_call					// a traced call
+  {
+	struct	fa_trace_record sRec;		// as traced
+	char	*cpSQL;						// null terminated SQL script or 0
+	int		iFile;						// database this call used
+	long long lTime;					// nanoseconds the replayed call took
+  };
+
+struct fa_replay_thread					// a replay thread
+  {
+	pthread_t	tid;
+	unsigned long long lThread;			// traced thread replayed
+	int		*ipCall;					// index of each call replayed by this thread
+	int		iCalls;
+	sqlite3	*db[FA_LUN_M0];				// connections by traced lun
+	sqlite3_stmt *row[FA_LUN_M0];		// prepared statement by traced lun
+  };
+
+static struct fa_replay_call *spCall = 0;	// all traced calls
+static int iCalls = 0;
+static char *cpFile[FA_REPLAY_FILE_M0];		// database copies to replay against
+static int iFiles = 0;
+static struct fa_replay_thread sThread[FA_REPLAY_THREAD_M0];
+static int iThreads = 0;
+static int iPace = 0;						// keep original timing?
+static struct timespec sReplayStart;
+static int iSkipped = 0;
+static int iErrors = 0;
+static pthread_mutex_t sCount = PTHREAD_MUTEX_INITIALIZER;
+
+
+static long long fa_replay_ns(struct timespec *sp)		// nanoseconds since replay started
+  {
+	return (sp->tv_sec-sReplayStart.tv_sec)*1000000000LL+sp->tv_nsec-sReplayStart.tv_nsec;
+  }
+
+
+static int fa_replay_call(struct fa_replay_thread *spT, struct fa_replay_call *spC)	// replay one call
+  {
+	int iAction = spC->sRec.iAction;
+	int iLun = spC->sRec.iLun;
+	int ios = SQLITE_OK;
+	const char *cpTail = spC->cpSQL;
+
+	if (iAction & (FA_INIT+FA_EXPORT+FA_IMPORT) || iLun < 0 || iLun >= FA_LUN_M0 || spC->iFile < 0)
+		return -1;												// not replayable
+
+	if (spT->db[iLun] == 0 && !(iAction & FA_CLOSE))			// connect to database when 1st used
+	  {
+		if ((ios=sqlite3_open(cpFile[spC->iFile], &spT->db[iLun])) != SQLITE_OK) return ios;
+		sqlite3_busy_timeout(spT->db[iLun], FA_REPLAY_BUSY_IV0);
+	  }
+
+	if (spT->row[iLun] != 0 && (iAction & (FA_FINALISE+FA_CLOSE) || spC->cpSQL != 0))
+	  {
+		sqlite3_finalize(spT->row[iLun]);						// as fa_sql_handler's tidy-up
+		spT->row[iLun]=0;
+	  }
+
+	if (iAction & FA_CLOSE)
+	  {
+		sqlite3_close(spT->db[iLun]);
+		spT->db[iLun]=0;
+	  }
+	else if (iAction & FA_OPEN)
+		;														// already connected
+	else if (spC->cpSQL != 0 && iAction & (FA_PREPARE+FA_READ))
+		while ((ios=sqlite3_prepare_v2(spT->db[iLun], cpTail, -1, &spT->row[iLun], &cpTail)) == SQLITE_OK)
+		  {
+			while (isspace((unsigned char) *cpTail)) cpTail++;
+			if (*cpTail == 0 || spT->row[iLun] == 0) break;		// keep the last statement to step through
+
+			while ((ios=sqlite3_step(spT->row[iLun])) == SQLITE_ROW);	// run any before it
+			sqlite3_finalize(spT->row[iLun]);
+			spT->row[iLun]=0;
+			if (ios != SQLITE_DONE) break;
+		  }
+	else if (spC->cpSQL != 0 && iAction & (FA_EXEC+FA_WRITE+FA_UPDATE+FA_DELETE))
+		ios=sqlite3_exec(spT->db[iLun], spC->cpSQL, 0, 0, 0);
+
+	if (ios == SQLITE_OK && iAction & FA_RESET && spT->row[iLun] != 0)
+		ios=sqlite3_reset(spT->row[iLun]);
+
+	if (ios == SQLITE_OK && iAction & FA_STEP && spT->row[iLun] != 0)
+		if ((ios=sqlite3_step(spT->row[iLun])) == SQLITE_ROW || ios == SQLITE_DONE)
+			ios=SQLITE_OK;
+
+	return ios;
+  }
+
+
+static void *fa_replay_thread(void *vp)				// replay a thread's calls in order
+  {
+	struct fa_replay_thread *spT = vp;
+	struct fa_replay_call *spC;
+	struct timespec sStart, sEnd, sWait;
+	long long lWait;
+	int i, ios;
+
+	for (i=0; i < spT->iCalls; i++)
+	  {
+		spC=&spCall[spT->ipCall[i]];
+
+		clock_gettime(CLOCK_MONOTONIC, &sStart);
+		if (iPace && (lWait=spC->sRec.lStart-spCall[0].sRec.lStart-fa_replay_ns(&sStart)) > 0)
+		  {
+			sWait.tv_sec=lWait/1000000000LL;			// wait until call's original start time
+			sWait.tv_nsec=lWait%1000000000LL;
+			nanosleep(&sWait, 0);
+			clock_gettime(CLOCK_MONOTONIC, &sStart);
+		  }
+
+		ios=fa_replay_call(spT, spC);
+
+		clock_gettime(CLOCK_MONOTONIC, &sEnd);
+		spC->lTime=fa_replay_ns(&sEnd)-fa_replay_ns(&sStart);
+
+		if (ios != SQLITE_OK)
+		  {
+			pthread_mutex_lock(&sCount);
+			if (ios < 0)
+				iSkipped++;
+			else
+			  {
+				iErrors++;
+				fprintf(stderr, "fa_replay: call %d error %d: %s\n", spT->ipCall[i]+1, ios,
+						spT->db[spC->sRec.iLun] ? sqlite3_errmsg(spT->db[spC->sRec.iLun]) : "no db");
+			  }
+			pthread_mutex_unlock(&sCount);
+			spC->lTime=-1;
+		  }
+	  }
+
+	for (i=0; i < FA_LUN_M0; i++)						// tidy up
+	  {
+		if (spT->row[i] != 0) sqlite3_finalize(spT->row[i]);
+		if (spT->db[i] != 0) sqlite3_close(spT->db[i]);
+	  }
+	return 0;
+  }
+
+
+static int fa_replay_cmp(const void *vp1, const void *vp2)
+  {
+	long long l1 = *(long long *)vp1, l2 = *(long long *)vp2;
+	return (l1 > l2) - (l1 < l2);
+  }
+
+
+static void fa_replay_report(char *cpName, long long *lpTime, int iCount)	// latency percentiles
+  {
+	qsort(lpTime, iCount, sizeof(long long), fa_replay_cmp);
+	printf(	"  %-10s %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+			cpName,
+			lpTime[iCount/2]/1e3,
+			lpTime[iCount*90/100]/1e3,
+			lpTime[iCount*95/100]/1e3,
+			lpTime[iCount*99/100]/1e3,
+			lpTime[iCount-1]/1e3);
+  }
+
+
+int main(int argc, char *argv[])
+  {
+	struct fa_trace_header sHead;
+	struct fa_trace_record sRec;
+	struct timespec sEnd;
+	long long *lpTraced, *lpReplayed;
+	int iLunFile[FA_LUN_M0];
+	int iThreaded = 0;
+	int i, j, c;
+	double dSecs;
+	FILE *fp;
+
+	while ((c=getopt(argc, argv, "ct")) != -1)
+	  {
+		if (c == 'c')
+			iThreaded=1;
+		else if (c == 't')
+			iPace=1;
+		else
+			goto usage;
+	  }
+	if (argc-optind < 2 || argc-optind-1 > FA_REPLAY_FILE_M0) goto usage;
+
+	if ((fp=fopen(argv[optind], "r")) == 0)
+	  {
+		perror(argv[optind]);
+		return 1;
+	  }
+	if (fread(&sHead, sizeof(sHead), 1, fp) != 1 || memcmp(sHead.sMagic, FA_TRACE_MAGIC, 4) != 0)
+	  {
+		fprintf(stderr, "fa_replay: not a trace file %s\n", argv[optind]);
+		return 1;
+	  }
+
+	for (i=0; i < FA_LUN_M0; i++)
+		iLunFile[i]=0;								// luns already open use the 1st database
+
+	while (fread(&sRec, sizeof(sRec), 1, fp) == 1)	// load every traced call
+	  {
+		if (iCalls % 1024 == 0 &&
+			(spCall=realloc(spCall, (iCalls+1024)*sizeof(struct fa_replay_call))) == 0)
+		  {
+			fprintf(stderr, "fa_replay: out of memory\n");
+			return 1;
+		  }
+		spCall[iCalls].sRec=sRec;
+		spCall[iCalls].cpSQL=0;
+		spCall[iCalls].iFile=-1;
+		if (sRec.iLen > 0)
+		  {
+			spCall[iCalls].cpSQL=malloc(sRec.iLen+1);
+			if (spCall[iCalls].cpSQL == 0 || fread(spCall[iCalls].cpSQL, 1, sRec.iLen, fp) != sRec.iLen)
+			  {
+				fprintf(stderr, "fa_replay: truncated trace at call %d\n", iCalls+1);
+				return 1;
+			  }
+			spCall[iCalls].cpSQL[sRec.iLen]=0;
+		  }
+
+		if (sRec.iLun >= 0 && sRec.iLun < FA_LUN_M0)
+		  {
+			if (sRec.iAction & FA_OPEN && spCall[iCalls].cpSQL != 0)	// map database to one of our copies
+			  {
+				for (j=0; j < iFiles && strcmp(cpFile[j], spCall[iCalls].cpSQL) != 0; j++);
+				if (j == iFiles)
+				  {
+					if (iFiles >= argc-optind-1)
+					  {
+						fprintf(stderr, "fa_replay: no database copy for %s\n", spCall[iCalls].cpSQL);
+						return 1;
+					  }
+					cpFile[iFiles++]=spCall[iCalls].cpSQL;
+				  }
+				iLunFile[sRec.iLun]=j;
+			  }
+			spCall[iCalls].iFile=iLunFile[sRec.iLun];
+		  }
+
+		j=0;										// which thread replays this call?
+		if (iThreaded)
+			for (j=0; j < iThreads && sThread[j].lThread != sRec.lThread; j++);
+		if (j == iThreads)
+		  {
+			if (iThreads >= FA_REPLAY_THREAD_M0)
+			  {
+				fprintf(stderr, "fa_replay: too many threads\n");
+				return 1;
+			  }
+			sThread[iThreads++].lThread=sRec.lThread;
+		  }
+		if (sThread[j].iCalls % 1024 == 0 &&
+			(sThread[j].ipCall=realloc(sThread[j].ipCall, (sThread[j].iCalls+1024)*sizeof(int))) == 0)
+		  {
+			fprintf(stderr, "fa_replay: out of memory\n");
+			return 1;
+		  }
+		sThread[j].ipCall[sThread[j].iCalls++]=iCalls++;
+	  }
+	fclose(fp);
+
+	if (iCalls == 0)
+	  {
+		fprintf(stderr, "fa_replay: empty trace\n");
+		return 1;
+	  }
+
+	for (i=0; i < FA_REPLAY_FILE_M0; i++)			// replace traced names with our copies
+		cpFile[i]=(i < argc-optind-1) ? argv[optind+1+i] : 0;
+	if (iFiles == 0) iFiles=1;
+
+	printf(	"replaying %d calls by pid %d, %d thread(s), %d database(s)\n", iCalls, sHead.iPid, iThreads, iFiles);
+
+	clock_gettime(CLOCK_MONOTONIC, &sReplayStart);
+	for (i=0; i < iThreads; i++)
+		if (pthread_create(&sThread[i].tid, 0, fa_replay_thread, &sThread[i]) != 0)
+		  {
+			fprintf(stderr, "fa_replay: thread create failed\n");
+			return 1;
+		  }
+	for (i=0; i < iThreads; i++)
+		pthread_join(sThread[i].tid, 0);
+	clock_gettime(CLOCK_MONOTONIC, &sEnd);
+	dSecs=fa_replay_ns(&sEnd)/1e9;
+
+	lpTraced=malloc(iCalls*sizeof(long long));
+	lpReplayed=malloc(iCalls*sizeof(long long));
+	if (lpTraced == 0 || lpReplayed == 0)
+	  {
+		fprintf(stderr, "fa_replay: out of memory\n");
+		return 1;
+	  }
+	for (i=0, j=0; i < iCalls; i++)					// compare calls that were replayed
+		if (spCall[i].lTime >= 0)
+		  {
+			lpTraced[j]=spCall[i].sRec.lTime;
+			lpReplayed[j++]=spCall[i].lTime;
+		  }
+
+	printf(	"replayed %d calls (%d skipped, %d errors) in %.3fs - %.0f calls/s\n",
+			j, iSkipped, iErrors, dSecs, dSecs > 0 ? j/dSecs : 0);
+	printf(	"traced %.3fs - %.0f calls/s\n",
+			(spCall[iCalls-1].sRec.lStart+spCall[iCalls-1].sRec.lTime-spCall[0].sRec.lStart)/1e9,
+			iCalls*1e9/(spCall[iCalls-1].sRec.lStart+spCall[iCalls-1].sRec.lTime-spCall[0].sRec.lStart+1));
+	if (j > 0)
+	  {
+		printf("  latency us        p50        p90        p95        p99        max\n");
+		fa_replay_report("traced", lpTraced, j);
+		fa_replay_report("replayed", lpReplayed, j);
+	  }
+
+	return (iErrors == 0) ? 0 : 1;
+
+usage:
+	fprintf(stderr, "usage: fa_replay [-c] [-t] trace database [database...]\n");
+	return 1;
+  }
@@ -0,0 +1,370 @@
+//--------------------------------------------------------------
+//
+// Generate database definitions and specialised per-table functions from a schema description
+//
+//	usage:	fa_schema_gen schema output
+//		where	schema is a schema description file (usually *.fas)
+//				output is the base name of the generated files - output.h and output.c
+//		returns 0 if ok, else 1
+//
+//	Schema descriptions contain one definition per line, blank lines and lines starting # are ignored:-
+//
+//		db		name path file			- database variable name, directory path and file name
+//		key		template				- SQL key template, in FA_KEYx order. i.e. key p.id = %
+//		table	name alias [join]		- table name, alias and any JOIN condition. i.e. table child c c.parent = p.id
+//		col		name type [size] [prime] [auto]	- column in table order. type is int, char or blob
+//											(blob needs a size, including a null terminator)
+//
+// The generated header declares a row structure per table (where data is unpacked to and written from),
+//	a bitmap define per column for bmField and the fa_sql_db structure. The generated code fills the
+//	fa_sql_db/fa_sql_table/fa_sql_column arrays and adds straight-line functions per table to unpack rows
+//	and bind a row's values to an INSERT, which fa_handler uses instead of its generic name matching and
+//	SQL generation. fa_sql_handler prepares the INSERT once per lun and set of columns, then re-uses it.
+//	Only INSERTs are specialised - UPDATEs, DELETEs and key SELECTs still use generated SQL text.
+//
+//	Columns must be listed in the same order as they are selected. The SQL generator lists the columns
+//	of tables with specialised functions, rather than using SELECT *, to ensure this.
+//
+//	GNU GPLv3 licence	libgxtfa by Andrew Bennington 2017 [www.benningtons.net]
+//
+//--------------------------------------------------------------
+
+#include <ctype.h>			// character tests such as isspace
+#include <stdio.h>			// standard I/O
+#include <stdlib.h>			// conversions such as atoi
+#include <string.h>			// string functions such as strcmp
+
+#include <fa_sql_def.h>		// format of SQL database, table and column definitions
+
+#define	FA_GEN_TAB_M0		20			// Limits number of tables in a schema
+#define	FA_GEN_COL_M0		32			// Limits number of columns in a table - one per bmField bit
+#define	FA_GEN_LINE_S0		200			// Limits size of a schema line
+
+
+struct fa_gen_column
+  {
+	char	sName[FA_COLUMN_NAME_S0];		// column name
+	int		bmFlag;							// bitmap of column options
+	int		iSize;							// size of column data
+  };
+
+struct fa_gen_table
+  {
+	char	sName[FA_TABLE_NAME_S0];		// table name
+	char	sAlias[FA_ALIAS_NAME_S0];		// table alias
+	char	sJoin[FA_KEY_S0];				// JOIN condition or empty
+	int		iCol;							// column count
+	struct	fa_gen_column sCol[FA_GEN_COL_M0];
+  };
+
+static char sDbName[FA_TABLE_NAME_S0];		// C variable name for the database
+static char sDbPath[FA_PATHNAME_S0];
+static char sDbFile[FA_FILENAME_S0];
+static char sKey[FA_KEY_M0][FA_KEY_S0];
+static int iKey = 0;
+static struct fa_gen_table sTab[FA_GEN_TAB_M0];
+static int iTab = 0;
+
+
+static void fa_schema_gen_copy(char *cpO, char *cpI, int iSize)	// copy a name, truncating if too long
+  {
+	while (*cpI != 0 && --iSize > 0)
+		*cpO++=*cpI++;
+	*cpO=0;
+  }
+
+
+static int fa_schema_gen_read(FILE *fp)		// load a schema description
+  {
+	char sLine[FA_GEN_LINE_S0];
+	char sWord[4][FA_GEN_LINE_S0];
+	struct fa_gen_table *spTab = 0;
+	struct fa_gen_column *spCol;
+	char *cp;
+	int iLine = 0;
+	int i, iLen;
+
+	while (fgets(sLine, FA_GEN_LINE_S0, fp) != 0)
+	  {
+		iLine++;
+		sLine[strcspn(sLine, "\r\n")]=0;
+		if (sscanf(sLine, "%s", sWord[0]) != 1 || sWord[0][0] == '#') continue;	// blank or comment
+
+		if (strcmp(sWord[0], "db") == 0)
+		  {
+			if (sscanf(sLine, "%*s %s %s %s", sWord[1], sWord[2], sWord[3]) != 3) goto error;
+			fa_schema_gen_copy(sDbName, sWord[1], FA_TABLE_NAME_S0);
+			fa_schema_gen_copy(sDbPath, sWord[2], FA_PATHNAME_S0);
+			fa_schema_gen_copy(sDbFile, sWord[3], FA_FILENAME_S0);
+		  }
+		else if (strcmp(sWord[0], "key") == 0)
+		  {
+			if (iKey >= FA_KEY_M0) goto error;
+			cp=sLine+strspn(sLine, " \t")+3;				// rest of line after "key"
+			cp+=strspn(cp, " \t");
+			snprintf(sKey[iKey++], FA_KEY_S0, "%s ", cp);	// key parser needs a trailing space
+		  }
+		else if (strcmp(sWord[0], "table") == 0)
+		  {
+			if (iTab >= FA_GEN_TAB_M0) goto error;
+			spTab=&sTab[iTab++];
+			iLen=strlen(sLine);
+			if (sscanf(sLine, "%*s %s %s %n", sWord[1], sWord[2], &iLen) != 2) goto error;
+			fa_schema_gen_copy(spTab->sName, sWord[1], FA_TABLE_NAME_S0);
+			fa_schema_gen_copy(spTab->sAlias, sWord[2], FA_ALIAS_NAME_S0);
+			snprintf(spTab->sJoin, FA_KEY_S0, "%s", sLine+iLen);
+		  }
+		else if (strcmp(sWord[0], "col") == 0)
+		  {
+			if (spTab == 0 || spTab->iCol >= FA_GEN_COL_M0) goto error;
+			spCol=&spTab->sCol[spTab->iCol++];
+
+			iLen=strlen(sLine);
+			i=sscanf(sLine, "%*s %s %s %n", sWord[1], sWord[2], &iLen);
+			if (i != 2) goto error;
+			fa_schema_gen_copy(spCol->sName, sWord[1], FA_COLUMN_NAME_S0);
+
+			if (strcmp(sWord[2], "int") == 0)
+			  {
+				spCol->bmFlag=FA_COL_INT_B0;
+				spCol->iSize=FA_FIELD_INT_S0;
+			  }
+			else if (strcmp(sWord[2], "char") == 0)
+			  {
+				spCol->bmFlag=FA_COL_CHAR_B0;
+				spCol->iSize=FA_FIELD_CHAR_S0;
+			  }
+			else if (strcmp(sWord[2], "blob") == 0)
+				spCol->bmFlag=FA_COL_BLOB_B0;
+			else
+				goto error;
+
+			cp=sLine+iLen;								// optional size and flags
+			while (sscanf(cp, "%s%n", sWord[3], &iLen) == 1)
+			  {
+				if (isdigit(sWord[3][0]))
+					spCol->iSize=atoi(sWord[3]);
+				else if (strcmp(sWord[3], "prime") == 0)
+					spCol->bmFlag|=FA_COL_PRIME_B0;
+				else if (strcmp(sWord[3], "auto") == 0)
+					spCol->bmFlag|=FA_COL_AUTO_B0;
+				else
+					goto error;
+				cp+=iLen;
+			  }
+			if (spCol->iSize < 1) goto error;
+		  }
+		else
+			goto error;
+	  }
+
+	if (sDbName[0] == 0 || iTab == 0)
+	  {
+		fprintf(stderr, "fa_schema_gen: no db or tables defined\n");
+		return -1;
+	  }
+	return 0;
+
+error:
+	fprintf(stderr, "fa_schema_gen: line %d not understood: %s\n", iLine, sLine);
+	return -1;
+  }
+
+
+static void fa_schema_gen_upper(char *cpO, char *cpI, int iSize)	// copy an upper case name for #defines
+  {
+	while (*cpI != 0 && --iSize > 0)
+		*cpO++=toupper(*cpI++);
+	*cpO=0;
+  }
+
+
+static void fa_schema_gen_header(FILE *fp, char *cpBase)	// output header of row structures and bitmaps
+  {
+	struct fa_gen_table *spTab;
+	struct fa_gen_column *spCol;
+	char sGuard[FA_GEN_LINE_S0];
+	char sUpTab[FA_TABLE_NAME_S0];
+	char sUpCol[FA_COLUMN_NAME_S0];
+	int i, j;
+
+	fa_schema_gen_upper(sGuard, strrchr(cpBase, '/') ? strrchr(cpBase, '/')+1 : cpBase, FA_GEN_LINE_S0);
+
+	fprintf(fp,	"//--------------------------------------------------------------\n"
+				"//\n"
+				"// Database definitions for %s - generated by fa_schema_gen, do not edit\n"
+				"//\n"
+				"//--------------------------------------------------------------\n\n"
+				"#ifndef __%s_INCLUDED__\n"
+				"#define __%s_INCLUDED__\n\n"
+				"#include <fa_sql_def.h>\n", sDbName, sGuard, sGuard);
+
+	for (i=0, spTab=sTab; i < iTab; i++, spTab++)
+	  {
+		fa_schema_gen_upper(sUpTab, spTab->sName, FA_TABLE_NAME_S0);
+
+		fprintf(fp, "\n#define\t%s_TAB\t(&%s_tab[%d])\t// table to set bmField on\n", sUpTab, sDbName, i);
+		for (j=0, spCol=spTab->sCol; j < spTab->iCol; j++, spCol++)
+		  {
+			fa_schema_gen_upper(sUpCol, spCol->sName, FA_COLUMN_NAME_S0);
+			fprintf(fp, "#define\t%s_%s_B0\t0x%08X\n", sUpTab, sUpCol, 1u<<j);
+		  }
+
+		fprintf(fp, "\nstruct %s_row\n  {\n", spTab->sName);
+		for (j=0, spCol=spTab->sCol; j < spTab->iCol; j++, spCol++)
+		  {
+			if (spCol->bmFlag & FA_COL_INT_B0)
+				fprintf(fp, "\tint\t\t%s;\n", spCol->sName);
+			else if (spCol->bmFlag & FA_COL_CHAR_B0)
+				fprintf(fp, "\tchar\t%s;\n", spCol->sName);
+			else
+				fprintf(fp, "\tchar\t%s[%d];\n", spCol->sName, spCol->iSize);
+		  }
+		fprintf(fp, "  };\nextern struct %s_row %s;\n", spTab->sName, spTab->sName);
+	  }
+
+	fprintf(fp,	"\nextern struct fa_sql_table %s_tab[];\n"
+				"extern struct fa_sql_db %s;\n\n"
+				"#endif\n", sDbName, sDbName);
+  }
+
+
+static void fa_schema_gen_code(FILE *fp, char *cpBase)	// output definitions and specialised functions
+  {
+	struct fa_gen_table *spTab;
+	struct fa_gen_column *spCol;
+	int i, j;
+	int iColMax = 0;
+
+	fprintf(fp,	"//--------------------------------------------------------------\n"
+				"//\n"
+				"// Database definitions and specialised functions for %s - generated by fa_schema_gen, do not edit\n"
+				"//\n"
+				"//--------------------------------------------------------------\n\n"
+				"#include <sqlite3.h>\n"
+				"#include <string.h>\n\n"
+				"#include <fa_sql_def.h>\n"
+				"#include \"%s.h\"\n\n", sDbName, strrchr(cpBase, '/') ? strrchr(cpBase, '/')+1 : cpBase);
+
+	fprintf(fp,	"static void fa_gen_text(sqlite3_stmt *row, int i, char *cpO, int iSize)\n"
+				"  {\n"
+				"\tint iLen = sqlite3_column_bytes(row, i);\n"
+				"\tconst void *vp = sqlite3_column_blob(row, i);\n\n"
+				"\tif (iLen >= iSize) iLen=iSize-1;\n"
+				"\tif (vp != 0) memcpy(cpO, vp, iLen);\n"
+				"\tcpO[iLen]=0;\n"
+				"  }\n");
+
+	for (i=0, spTab=sTab; i < iTab; i++, spTab++)
+	  {
+		if (spTab->iCol > iColMax) iColMax=spTab->iCol;
+
+		fprintf(fp, "\nstruct %s_row %s;\n", spTab->sName, spTab->sName);
+
+		fprintf(fp,	"\nstatic int fa_gen_unpack_%s(void *vpRow, int bmField)\n"
+					"  {\n"
+					"\tsqlite3_stmt *row = vpRow;\n"
+					"\tint i = 0;\n\n", spTab->sName);
+		for (j=0, spCol=spTab->sCol; j < spTab->iCol; j++, spCol++)
+		  {
+			fprintf(fp, "\tif (bmField & 0x%08X) ", 1u<<j);
+			if (spCol->bmFlag & FA_COL_INT_B0)
+				fprintf(fp, "%s.%s=sqlite3_column_int(row, i++);\n", spTab->sName, spCol->sName);
+			else if (spCol->bmFlag & FA_COL_CHAR_B0)
+				fprintf(fp,	"{ const char *cp = sqlite3_column_blob(row, i++); %s.%s=(cp != 0) ? *cp : 0; }\n",
+							spTab->sName, spCol->sName);
+			else
+				fprintf(fp,	"fa_gen_text(row, i++, %s.%s, %d);\n", spTab->sName, spCol->sName, spCol->iSize);
+		  }
+		fprintf(fp, "\treturn i;\n  }\n");
+
+		fprintf(fp,	"\nstatic int fa_gen_write_%s(void *vpRow, int bmField)\n"
+					"  {\n"
+					"\tsqlite3_stmt *row = vpRow;\n"
+					"\tint i = 1;\n\n", spTab->sName);
+		for (j=0, spCol=spTab->sCol; j < spTab->iCol; j++, spCol++)
+		  {
+			if (spCol->bmFlag & FA_COL_AUTO_B0) continue;
+			fprintf(fp, "\tif (bmField & 0x%08X) ", 1u<<j);
+			if (spCol->bmFlag & FA_COL_INT_B0)
+				fprintf(fp, "sqlite3_bind_int(row, i++, %s.%s);\n", spTab->sName, spCol->sName);
+			else if (spCol->bmFlag & FA_COL_CHAR_B0)
+				fprintf(fp, "sqlite3_bind_text(row, i++, &%s.%s, 1, SQLITE_STATIC);\n", spTab->sName, spCol->sName);
+			else
+				fprintf(fp, "sqlite3_bind_text(row, i++, %s.%s, -1, SQLITE_STATIC);\n", spTab->sName, spCol->sName);
+		  }
+		fprintf(fp,	"\treturn SQLITE_OK;\n"
+					"  }\n");
+
+		fprintf(fp, "\nstatic struct fa_sql_column %s_col[] =\n  {\n", spTab->sName);
+		for (j=0, spCol=spTab->sCol; j < spTab->iCol; j++, spCol++)
+			fprintf(fp,	"\t{\"%s\", 0x%08X, %s%s.%s, %d},\n",
+						spCol->sName,
+						spCol->bmFlag,
+						(spCol->bmFlag & FA_COL_BLOB_B0) ? "" : "(char *)&",
+						spTab->sName,
+						spCol->sName,
+						spCol->iSize);
+		fprintf(fp, "  };\n");
+	  }
+
+	fprintf(fp, "\nstruct fa_sql_table %s_tab[] =\n  {\n", sDbName);
+	for (i=0, spTab=sTab; i < iTab; i++, spTab++)
+	  {
+		fprintf(fp,	"\t{\"%s\", \"%s\", %d, 0, %s_col, ", spTab->sName, spTab->sAlias, spTab->iCol, spTab->sName);
+		if (spTab->sJoin[0] != 0)
+			fprintf(fp, "\"%s\", ", spTab->sJoin);
+		else
+			fprintf(fp, "0, ");
+		fprintf(fp, "fa_gen_unpack_%s, fa_gen_write_%s},\n", spTab->sName, spTab->sName);
+	  }
+	fprintf(fp, "  };\n");
+
+	fprintf(fp,	"\nstruct fa_sql_db %s =\n  {\n"
+				"\t\"%s\", \"%s\", %d, %d, %d, 0, %s_tab,\n"
+				"\t  {\n", sDbName, sDbPath, sDbFile, iTab, iColMax, iKey, sDbName);
+	for (i=0; i < iKey; i++)
+		fprintf(fp, "\t\t\"%s\",\n", sKey[i]);
+	fprintf(fp, "\t  }\n  };\n");
+  }
+
+
+int main(int argc, char *argv[])
+  {
+	char sName[FA_GEN_LINE_S0];
+	FILE *fp;
+
+	if (argc != 3)
+	  {
+		fprintf(stderr, "usage: fa_schema_gen schema output\n");
+		return 1;
+	  }
+
+	if ((fp=fopen(argv[1], "r")) == 0)
+	  {
+		perror(argv[1]);
+		return 1;
+	  }
+	if (fa_schema_gen_read(fp) != 0) return 1;
+	fclose(fp);
+
+	snprintf(sName, FA_GEN_LINE_S0, "%s.h", argv[2]);
+	if ((fp=fopen(sName, "w")) == 0)
+	  {
+		perror(sName);
+		return 1;
+	  }
+	fa_schema_gen_header(fp, argv[2]);
+	fclose(fp);
+
+	snprintf(sName, FA_GEN_LINE_S0, "%s.c", argv[2]);
+	if ((fp=fopen(sName, "w")) == 0)
+	  {
+		perror(sName);
+		return 1;
+	  }
+	fa_schema_gen_code(fp, argv[2]);
+	fclose(fp);
+
+	return 0;
+  }
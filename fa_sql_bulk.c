@@ -0,0 +1,406 @@
+//--------------------------------------------------------------
+//
+// Bulk export/import of a database table to/from a file - streamed a row at a time through fixed size
+//	buffers so tables of any size can be transferred in constant memory
+//
+//	usage:	status = fa_sql_bulk(action, file, database-definition)
+//		where:-	action is a bitmap of filehandler commands - see fa_def.h
+//				file points to a string containing the name of the file to export to or import from
+//				database-definition points to a structure where the database, tables and fields are defined.
+//
+//		actions supported:-
+//			FA_EXPORT	- Write the selected columns of every row in the 1st table with selected fields to file
+//			FA_IMPORT	- INSERT every row in file into the 1st table with selected fields. Columns are
+//							matched by the names held in the file's header so only need to be in the table.
+//							Rows are INSERTed in batched transactions, reusing one prepared statement.
+//							An import that fails part way only rolls back its current batch - the batches
+//							already committed stay in the table and their row count is logged with the error.
+//							Wrap the call in a transaction (FA_EXEC "BEGIN;") to import all rows or none.
+//			FA_BINARY	- Combine with the above to use a binary file format rather than CSV
+//
+//		CSV files have a header line of column names. Strings are quoted if needed, NULLs are empty fields.
+//		Binary files start "FAB1", a column count and the column names. Then every value is a 4 byte
+//			length followed by that many bytes of data (integers are 4 bytes), or a length of -1 for NULL.
+//			All lengths and integers are little-endian.
+//
+//		Values are limited to FA_BULK_FIELD_S0-1 bytes. Export fails on longer values rather than writing
+//			a file that import can't read back.
+//
+//		Each transfer logs its row count, size and throughput (rows/s, MB/s) to use as a benchmark.
+//
+//	GNU GPLv3 licence	libgxtfa by Andrew Bennington 2017 [www.benningtons.net]
+//
+//--------------------------------------------------------------
+
+#include <sqlite3.h>		//used for database application interface calls
+#include <stdio.h>			//standard I/O
+#include <stdlib.h>			//conversions such as atoi
+#include <string.h>			//string functions such as strcmp
+#include <time.h>			//clock_gettime for throughput
+
+
+#include <fa_def.h>			//filehandler actions
+#include <fa_lun.h>			//table of file/database and prepared command handles
+#include <fa_sql_def.h>		//format for holding details of any SQL database to enable unpacking of data
+#include <ut_error.h>		//error and debug functions
+
+#define	FA_BULK_BUFFER_S0	65536		// Size of file I/O buffers
+#define	FA_BULK_FIELD_S0	4096		// Limits size of a single column value
+#define	FA_BULK_BATCH_M0	1000		// Number of rows to INSERT per transaction
+#define	FA_BULK_MAGIC		"FAB1"		// Identifies binary format files
+#define	FA_BULK_NULL		0xFFFFFFFF	// Binary length used for NULL values
+#define	FA_BULK_LONG_IV0	-2			// CSV field too long - distinct from EOF
+
+
+static void fa_sql_bulk_put32(unsigned int iValue, FILE *fp)	// output little-endian 32 bit value
+  {
+	putc_unlocked(iValue & 0xFF, fp);
+	putc_unlocked((iValue >> 8) & 0xFF, fp);
+	putc_unlocked((iValue >> 16) & 0xFF, fp);
+	putc_unlocked((iValue >> 24) & 0xFF, fp);
+  }
+
+
+static int fa_sql_bulk_get32(unsigned int *ipValue, FILE *fp)	// input little-endian 32 bit value
+  {
+	unsigned char s[4];
+
+	if (fread(s, 4, 1, fp) != 1) return EOF;
+	*ipValue=s[0] | (s[1] << 8) | (s[2] << 16) | ((unsigned int) s[3] << 24);
+	return 0;
+  }
+
+
+static int fa_sql_bulk_csv(FILE *fp, char *cpO, int *ipLen, int *ipNull)	// input one CSV field
+  {															// returns ',', '\n' or EOF after the field
+																//	or FA_BULK_LONG_IV0 if too long
+	int c;
+	int iQuote = 0;											// within quotes?
+	int iLen = 0;
+
+	*ipNull=1;												// unquoted empty fields are NULL
+	while ((c=getc_unlocked(fp)) != EOF)
+	  {
+		if (iQuote)
+		  {
+			if (c == '"')
+			  {
+				if ((c=getc_unlocked(fp)) != '"')			// "" is an escaped quote, else end of quotes
+				  {
+					iQuote=0;
+					ungetc(c, fp);
+					continue;
+				  }
+			  }
+		  }
+		else if (c == '"')
+		  {
+			iQuote=1;
+			*ipNull=0;
+			continue;
+		  }
+		else if (c == ',' || c == '\n')
+			break;
+		else if (c == '\r')
+			continue;
+
+		if (iLen >= FA_BULK_FIELD_S0-1) return FA_BULK_LONG_IV0;
+		cpO[iLen++]=c;
+		*ipNull=0;
+	  }
+
+	cpO[iLen]=0;
+	*ipLen=iLen;
+	return (c == EOF && iLen == 0 && *ipNull) ? EOF : (c == EOF ? '\n' : c);
+  }
+
+
+int fa_sql_bulk(const int iAction,
+				char *cpFile,
+				struct fa_sql_db *spDB)
+  {
+	struct fa_sql_column *spSQLcol;		// used to step through the table's columns
+	struct fa_sql_column *spCol[32];	// columns transferred, in file order	#TODO limited by bmField
+	struct fa_sql_table *spSQLtable;	// table being transferred
+
+	sqlite3_stmt *row = 0;				// statement used for the transfer
+	struct timespec sStart, sEnd;
+	char sIO[FA_BULK_BUFFER_S0];		// file I/O buffer
+	char sField[FA_BULK_FIELD_S0];		// a single column value
+	char sBuff[FA_BUFFER_S0];			// SQL script
+	char *cp = &sBuff[0];
+	FILE *fp = 0;
+	unsigned int iLen;
+	int i, j, c;
+	int iCols = 0;						// number of columns transferred
+	int iNull;
+	int iTran = 0;						// set if an import transaction is open
+	int iOk = 0;						// set once the transfer has completed
+	long lRows = 0;
+	long lCommitted = 0;				// rows imported in committed batches
+	double dSecs;
+	int ios = SQLITE_OK;
+
+
+
+	clock_gettime(CLOCK_MONOTONIC, &sStart);
+
+	i=0;
+	spSQLtable=spDB->spTab;
+	while (spSQLtable->bmField == 0)	// same table as the SQL generator would use
+	  {
+		spSQLtable++;
+		ut_check(++i < spDB->iTab, "no fields");
+	  }
+
+	fp=fopen(cpFile, (iAction & FA_EXPORT) ? "w" : "r");
+	ut_check(fp != 0, "open: %s", cpFile);
+	setvbuf(fp, sIO, _IOFBF, FA_BULK_BUFFER_S0);
+
+	if (iAction & FA_EXPORT)			// Stream rows from the table to file
+	  {
+		j=snprintf(cp, FA_BUFFER_S0, "SELECT ");
+		cp+=j;
+
+		spSQLcol=spSQLtable->spCol;
+		for (i=0; i < spSQLtable->iCol; i++, spSQLcol++)
+			if ((spSQLtable->bmField>>i) & 1)
+			  {
+				spCol[iCols++]=spSQLcol;
+				cp+=snprintf(cp, FA_BUFFER_S0-(cp-sBuff), "%s, ", spSQLcol->sName);
+			  }
+		cp-=2;								// reverse back over the last ", "
+		snprintf(cp, FA_BUFFER_S0-(cp-sBuff), " FROM %s;", spSQLtable->sName);
+
+		ut_debug("fa_export: %s", sBuff);
+		ios=sqlite3_prepare_v2(fa_lun[spDB->iLun].db, sBuff, -1, &row, 0);
+		ut_check(ios == SQLITE_OK, "prepare: %d", ios);
+
+		if (iAction & FA_BINARY)			// header of magic, column count and names
+		  {
+			fputs(FA_BULK_MAGIC, fp);
+			fa_sql_bulk_put32(iCols, fp);
+			for (i=0; i < iCols; i++)
+			  {
+				fa_sql_bulk_put32(strlen(spCol[i]->sName), fp);
+				fputs(spCol[i]->sName, fp);
+			  }
+		  }
+		else								// header line of column names
+			for (i=0; i < iCols; i++)
+				fprintf(fp, "%s%c", spCol[i]->sName, (i < iCols-1) ? ',' : '\n');
+
+		while ((ios=sqlite3_step(row)) == SQLITE_ROW)
+		  {
+			for (i=0; i < iCols; i++)
+			  {
+				if (sqlite3_column_type(row, i) == SQLITE_NULL)
+				  {
+					if (iAction & FA_BINARY) fa_sql_bulk_put32(FA_BULK_NULL, fp);
+				  }
+				else if (spCol[i]->bmFlag & FA_COL_INT_B0)
+				  {
+					if (iAction & FA_BINARY)
+					  {
+						fa_sql_bulk_put32(FA_FIELD_INT_S0, fp);
+						fa_sql_bulk_put32(sqlite3_column_int(row, i), fp);
+					  }
+					else
+						fprintf(fp, "%d", sqlite3_column_int(row, i));
+				  }
+				else								// char, string or blob data
+				  {
+					if (iAction & FA_BINARY)
+						cp=(char *) sqlite3_column_blob(row, i);
+					else
+						cp=(char *) sqlite3_column_text(row, i);	// null terminated for strpbrk
+					iLen=sqlite3_column_bytes(row, i);
+					if (iLen >= FA_BULK_FIELD_S0) ios=-1;	// import couldn't read it back
+					ut_check(ios != -1, "field too long row %ld", lRows+1);
+					if (iAction & FA_BINARY)
+					  {
+						fa_sql_bulk_put32(iLen, fp);
+						fwrite(cp, 1, iLen, fp);
+					  }
+					else if (iLen == 0 || strpbrk(cp, ",\"\r\n") != 0)
+					  {								// quote anything that could confuse a CSV reader
+						putc_unlocked('"', fp);
+						for (j=0; j < iLen; j++)
+						  {
+							if (cp[j] == '"') putc_unlocked('"', fp);
+							putc_unlocked(cp[j], fp);
+						  }
+						putc_unlocked('"', fp);
+					  }
+					else
+						fwrite(cp, 1, iLen, fp);
+				  }
+
+				if (!(iAction & FA_BINARY))
+					putc_unlocked((i < iCols-1) ? ',' : '\n', fp);
+			  }
+			lRows++;
+		  }
+		ut_check(ios == SQLITE_DONE, "step %d", ios);
+		ios=SQLITE_OK;
+	  }
+
+	else if (iAction & FA_IMPORT)		// Stream rows from file into the table
+	  {
+		if (iAction & FA_BINARY)		// check header then read column count
+		  {
+			ut_check(fread(sField, 4, 1, fp) == 1 &&
+						strncmp(sField, FA_BULK_MAGIC, 4) == 0, "not binary: %s", cpFile);
+			ut_check(fa_sql_bulk_get32(&iLen, fp) == 0 && iLen > 0 && iLen <= 32, "columns: %d", iLen);
+			iCols=iLen;
+		  }
+
+		else
+			iCols=32;					// CSV header line sets the column count
+
+		j=snprintf(cp, FA_BUFFER_S0, "INSERT INTO %s (", spSQLtable->sName);
+		cp+=j;
+
+		c=0;
+		for (i=0; i < iCols && c != '\n'; i++)	// find each column named in the header
+		  {
+			if (iAction & FA_BINARY)
+			  {
+				ut_check(fa_sql_bulk_get32(&iLen, fp) == 0 && iLen < FA_COLUMN_NAME_S0 &&
+							fread(sField, 1, iLen, fp) == iLen, "header: %s", cpFile);
+				sField[iLen]=0;
+			  }
+			else
+			  {
+				c=fa_sql_bulk_csv(fp, sField, &j, &iNull);
+				ut_check(c == ',' || c == '\n', "header: %s", cpFile);
+			  }
+
+			spSQLcol=spSQLtable->spCol;
+			for (j=0; strcmp(spSQLcol->sName, sField) != 0; j++, spSQLcol++)
+				ut_check(j+1 < spSQLtable->iCol, "column name not found:%s", sField);
+			spCol[i]=spSQLcol;
+			cp+=snprintf(cp, FA_BUFFER_S0-(cp-sBuff), "%s, ", spSQLcol->sName);
+		  }
+		if (!(iAction & FA_BINARY))
+		  {
+			ut_check(c == '\n', "too many columns: %s", cpFile);
+			iCols=i;
+		  }
+		cp-=2;							// reverse back over the last ", "
+		cp+=snprintf(cp, FA_BUFFER_S0-(cp-sBuff), ") VALUES (");
+		for (i=0; i < iCols; i++)
+			cp+=snprintf(cp, FA_BUFFER_S0-(cp-sBuff), "?, ");
+		cp-=2;
+		snprintf(cp, FA_BUFFER_S0-(cp-sBuff), ");");
+
+		ut_debug("fa_import: %s", sBuff);
+		ios=sqlite3_prepare_v2(fa_lun[spDB->iLun].db, sBuff, -1, &row, 0);	// prepared once and reused
+		ut_check(ios == SQLITE_OK, "prepare: %d", ios);
+
+		while (1)						// for each row
+		  {
+			for (i=0; i < iCols; i++)
+			  {
+				if (iAction & FA_BINARY)
+				  {
+					if (fa_sql_bulk_get32(&iLen, fp) == EOF)
+					  {
+						ut_check(i == 0, "truncated row %ld", lRows+1);
+						goto done;
+					  }
+					iNull=(iLen == FA_BULK_NULL);
+					if (!iNull)
+						ut_check(iLen < FA_BULK_FIELD_S0 && fread(sField, 1, iLen, fp) == iLen,
+									"field too long row %ld", lRows+1);
+					if (!iNull && spCol[i]->bmFlag & FA_COL_INT_B0)
+						ut_check(iLen == FA_FIELD_INT_S0, "integer size row %ld", lRows+1);
+					j=iLen;
+				  }
+				else
+				  {
+					c=fa_sql_bulk_csv(fp, sField, &j, &iNull);
+					ut_check(c != FA_BULK_LONG_IV0, "field too long row %ld", lRows+1);
+					if (c == EOF && i == 0) goto done;
+					ut_check((c == '\n') == (i == iCols-1), "column count row %ld", lRows+1);
+				  }
+
+				if (iNull)
+					sqlite3_bind_null(row, i+1);
+				else if (spCol[i]->bmFlag & FA_COL_INT_B0)
+				  {
+					if (iAction & FA_BINARY)
+						sqlite3_bind_int(row, i+1, (unsigned char) sField[0] | ((unsigned char) sField[1] << 8) |
+										((unsigned char) sField[2] << 16) | ((unsigned int)(unsigned char) sField[3] << 24));
+					else
+						sqlite3_bind_int(row, i+1, atoi(sField));
+				  }
+				else
+					sqlite3_bind_text(row, i+1, sField, j, SQLITE_TRANSIENT);
+			  }
+
+			if (!iTran && sqlite3_get_autocommit(fa_lun[spDB->iLun].db))
+			  {							// INSERT in batches of rows per transaction, unless in the caller's
+				ios=sqlite3_exec(fa_lun[spDB->iLun].db, "BEGIN;", 0, 0, 0);
+				ut_check(ios == SQLITE_OK, "begin: %d", ios);
+				iTran=1;
+			  }
+
+			ios=sqlite3_step(row);
+			ut_check(ios == SQLITE_DONE, "insert row %ld: %d", lRows+1, ios);
+			sqlite3_reset(row);
+			sqlite3_clear_bindings(row);
+
+			if (++lRows % FA_BULK_BATCH_M0 == 0 && iTran)
+			  {
+				ios=sqlite3_exec(fa_lun[spDB->iLun].db, "COMMIT;", 0, 0, 0);
+				ut_check(ios == SQLITE_OK, "commit: %d", ios);
+				iTran=0;
+				lCommitted=lRows;
+				fa_sql_feed_flush(spDB->iLun);	// deliver each batch to subscribers as it is committed
+			  }
+		  }
+done:
+		if (iTran)
+		  {
+			ios=sqlite3_exec(fa_lun[spDB->iLun].db, "COMMIT;", 0, 0, 0);
+			ut_check(ios == SQLITE_OK, "commit: %d", ios);
+			iTran=0;
+		  }
+		ios=SQLITE_OK;
+	  }
+
+	else
+		ut_check(0, "unknown: %x", iAction);
+
+	clock_gettime(CLOCK_MONOTONIC, &sEnd);
+	dSecs=(sEnd.tv_sec-sStart.tv_sec)+(sEnd.tv_nsec-sStart.tv_nsec)/1e9;
+	ut_log(	"%s %s: %ld rows, %ld bytes in %.3fs - %.0f rows/s, %.1f MB/s",
+			(iAction & FA_EXPORT) ? "exported" : "imported",
+			spSQLtable->sName,
+			lRows,
+			ftell(fp),
+			dSecs,
+			dSecs > 0 ? lRows/dSecs : 0,
+			dSecs > 0 ? ftell(fp)/dSecs/1e6 : 0);
+	iOk=1;
+
+error:
+	fa_sql_feed_flush(spDB->iLun);		// deliver any committed changes to subscribers
+	if (!iOk)
+	  {
+		if (ios != SQLITE_OK && ios != SQLITE_DONE && ios != -1)	// an sqlite error?
+			ut_error("%s", sqlite3_errmsg(fa_lun[spDB->iLun].db));	// A more informative error description
+		else
+			ios=-1;
+		if (iAction & FA_IMPORT)
+			ut_error("import %s failed after %ld rows committed", cpFile, lCommitted);
+	  }
+	if (iTran)
+		sqlite3_exec(fa_lun[spDB->iLun].db, "ROLLBACK;", 0, 0, 0);	// drop any part imported batch
+	if (row != 0)
+		sqlite3_finalize(row);
+	if (fp != 0)
+		fclose(fp);
+	return ios;
+  }
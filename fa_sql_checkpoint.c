@@ -0,0 +1,231 @@
+//--------------------------------------------------------------
+//
+// Background WAL checkpoint scheduler - to keep checkpoint stalls out of calls writing to the database
+//
+//	usage:	status = fa_sql_checkpoint(action, database-definition)
+//		where:-	action is FA_OPEN to start checkpointing a database's WAL on a background thread or FA_CLOSE to stop
+//				database-definition points to an open database's definitions, with its checkpoint policy in spCkpt
+//		returns 0 if ok, else -1
+//
+//		Called by fa_sql_handler when opening and closing databases with a checkpoint policy. The database
+//			must already be in WAL mode. sqlite's auto-checkpoint is replaced by a WAL hook that counts the
+//			frames committed to the WAL, and the scheduler checks every iPollMs how many bytes of them are not
+//			yet checkpointed. Once that reaches iWalMin the WAL is checkpointed when the database has been idle
+//			(no fa_handler calls) for iIdleMs, or straight away once it reaches iWalMax. Using the policy's
+//			mode - FA_CKPT_PASSIVE, FA_CKPT_FULL, FA_CKPT_RESTART or FA_CKPT_TRUNCATE.
+//
+//		The WAL file itself only shrinks with FA_CKPT_TRUNCATE, so its size isn't used. Each checkpoint
+//			reports the frames in the WAL and those checkpointed, and a WAL hook count lower than the last
+//			shows the WAL has restarted from the beginning.
+//
+//		The scheduler uses its own connection so checkpoints don't hold up the calling program's connection.
+//		Checkpoint counts, durations and bytes not yet checkpointed are added to fa_sql_stats.
+//
+//	GNU GPLv3 licence	libgxtfa by Andrew Bennington 2017 [www.benningtons.net]
+//
+//--------------------------------------------------------------
+
+#include <errno.h>			//ETIMEDOUT
+#include <pthread.h>		//scheduler threads
+#include <sqlite3.h>		//used for database application interface calls
+#include <stdio.h>			//standard I/O
+#include <stdlib.h>			//memory allocation
+#include <string.h>			//string functions such as strcasecmp
+#include <time.h>			//clock_gettime for timings
+
+
+#include <fa_def.h>			//filehandler actions
+#include <fa_lun.h>			//table of file/database and prepared command handles
+#include <fa_sql_def.h>		//format for holding details of any SQL database to enable unpacking of data
+#include <ut_error.h>		//error and debug functions
+
+struct fa_sql_ckpt_lun					// a lun's checkpoint scheduler
+  {
+	pthread_t	tid;
+	pthread_mutex_t sLock;
+	pthread_cond_t sWake;				// signalled to stop the scheduler
+	int		iStop;
+	int		iLun;
+	sqlite3	*db;						// scheduler's own connection
+	int		iFrameBytes;				// size of each WAL frame - a page and its header
+	int		iFrames;					// frames in the WAL, from the WAL hook or last checkpoint
+	int		iBackfill;					//	of which have been checkpointed
+	struct	fa_sql_ckpt sPolicy;		// policy with any defaults applied
+  };
+
+static struct fa_sql_ckpt_lun *spSched[FA_LUN_M0];	// schedulers by lun
+
+
+static long long fa_sql_checkpoint_us(void)		// monotonic clock in microseconds
+  {
+	struct timespec sNow;
+
+	clock_gettime(CLOCK_MONOTONIC, &sNow);
+	return sNow.tv_sec*1000000LL+sNow.tv_nsec/1000;
+  }
+
+
+static int fa_sql_checkpoint_wal(void *vp, sqlite3 *db, const char *cpDb, int iFrames)
+  {											// sqlite WAL hook, after each commit by the calling program
+	struct fa_sql_ckpt_lun *spC = vp;
+
+	if (iFrames < __atomic_load_n(&spC->iFrames, __ATOMIC_RELAXED))
+		__atomic_store_n(&spC->iBackfill, 0, __ATOMIC_RELAXED);	// WAL restarted so nothing checkpointed
+	__atomic_store_n(&spC->iFrames, iFrames, __ATOMIC_RELAXED);
+	return SQLITE_OK;
+  }
+
+
+static long fa_sql_checkpoint_bytes(struct fa_sql_ckpt_lun *spC)	// WAL bytes not yet checkpointed
+  {
+	int iPending = __atomic_load_n(&spC->iFrames, __ATOMIC_RELAXED)-__atomic_load_n(&spC->iBackfill, __ATOMIC_RELAXED);
+
+	return (iPending > 0) ? (long) iPending*spC->iFrameBytes : 0;
+  }
+
+
+static int fa_sql_checkpoint_pragma(sqlite3 *db, const char *cpSQL, char *cpO, int iSize)
+  {											// return a PRAGMA's value as text
+	sqlite3_stmt *row = 0;
+	int ios;
+
+	ios=sqlite3_prepare_v2(db, cpSQL, -1, &row, 0);
+	if (ios == SQLITE_OK && (ios=sqlite3_step(row)) == SQLITE_ROW)
+	  {
+		snprintf(cpO, iSize, "%s", sqlite3_column_text(row, 0));
+		ios=SQLITE_OK;
+	  }
+	sqlite3_finalize(row);
+	return ios;
+  }
+
+
+static void *fa_sql_checkpoint_thread(void *vp)	// check WAL size and checkpoint when needed
+  {
+	struct fa_sql_ckpt_lun *spC = vp;
+	struct timespec sWake;
+	long long lStart, lTime;
+	long lBytes;
+	int iIdleMs;
+	int iLog, iCkpt;
+	int ios;
+
+	pthread_mutex_lock(&spC->sLock);
+	while (!spC->iStop)
+	  {
+		clock_gettime(CLOCK_REALTIME, &sWake);		// sleep until next check, or told to stop
+		sWake.tv_sec+=spC->sPolicy.iPollMs/1000;
+		sWake.tv_nsec+=(spC->sPolicy.iPollMs%1000)*1000000L;
+		if (sWake.tv_nsec >= 1000000000L)
+		  {
+			sWake.tv_sec++;
+			sWake.tv_nsec-=1000000000L;
+		  }
+		if (pthread_cond_timedwait(&spC->sWake, &spC->sLock, &sWake) != ETIMEDOUT || spC->iStop)
+			continue;
+
+		lBytes=fa_sql_checkpoint_bytes(spC);
+		__atomic_store_n(&fa_sql_stats.lWalBytes, lBytes, __ATOMIC_RELAXED);
+		if (lBytes < spC->sPolicy.iWalMin)
+			continue;								// not worth checkpointing yet
+
+		iIdleMs=(fa_sql_checkpoint_us()-__atomic_load_n(&fa_lun[spC->iLun].lActive, __ATOMIC_RELAXED))/1000;
+		if (lBytes < spC->sPolicy.iWalMax && iIdleMs < spC->sPolicy.iIdleMs)
+			continue;								// wait for the database to go quiet
+
+		ut_debug("checkpoint lun %d: %ld bytes idle %dms", spC->iLun, lBytes, iIdleMs);
+		lStart=fa_sql_checkpoint_us();
+		sqlite3_exec(spC->db, "PRAGMA schema_version;", 0, 0, 0);	// a read so our connection sees the WAL
+		ios=sqlite3_wal_checkpoint_v2(spC->db, 0, spC->sPolicy.iMode, &iLog, &iCkpt);
+		lTime=fa_sql_checkpoint_us()-lStart;
+
+		if ((ios == SQLITE_OK || ios == SQLITE_BUSY) && iLog >= 0)
+		  {											// busy checkpoints may still have done some frames
+			__atomic_store_n(&spC->iFrames, iLog, __ATOMIC_RELAXED);
+			__atomic_store_n(&spC->iBackfill, iCkpt, __ATOMIC_RELAXED);
+			__atomic_store_n(&fa_sql_stats.lWalBytes, fa_sql_checkpoint_bytes(spC), __ATOMIC_RELAXED);
+		  }
+		if (ios == SQLITE_OK)
+		  {
+			FA_STATS_ADD(lCkpt, 1);
+			FA_STATS_ADD(lCkptUs, lTime);
+			if (lTime > __atomic_load_n(&fa_sql_stats.lCkptMaxUs, __ATOMIC_RELAXED))
+				__atomic_store_n(&fa_sql_stats.lCkptMaxUs, lTime, __ATOMIC_RELAXED);
+		  }
+		else
+			FA_STATS_ADD(lCkptFail, 1);				// busy, so try again next time
+	  }
+	pthread_mutex_unlock(&spC->sLock);
+
+	return 0;
+  }
+
+
+int fa_sql_checkpoint(const int iAction, struct fa_sql_db *spDB)
+  {
+	struct fa_sql_ckpt_lun *spC = spSched[spDB->iLun];
+	char sValue[FA_COLUMN_NAME_S0];
+	int ios;
+
+	if (spC != 0)										// stop any current scheduler
+	  {
+		pthread_mutex_lock(&spC->sLock);
+		spC->iStop=1;
+		pthread_cond_signal(&spC->sWake);
+		pthread_mutex_unlock(&spC->sLock);
+		pthread_join(spC->tid, 0);
+
+		sqlite3_wal_hook(fa_lun[spDB->iLun].db, 0, 0);
+		sqlite3_close(spC->db);
+		pthread_cond_destroy(&spC->sWake);
+		pthread_mutex_destroy(&spC->sLock);
+		spSched[spDB->iLun]=0;
+		free(spC);
+	  }
+
+	if (iAction & FA_OPEN)
+	  {
+		ios=fa_sql_checkpoint_pragma(fa_lun[spDB->iLun].db, "PRAGMA journal_mode;", sValue, sizeof(sValue));
+		ut_check(ios == SQLITE_OK && strcasecmp(sValue, "wal") == 0,	// nothing to checkpoint otherwise
+				"checkpoint policy needs WAL mode: %s", (ios == SQLITE_OK) ? sValue : "?");
+		ios=fa_sql_checkpoint_pragma(fa_lun[spDB->iLun].db, "PRAGMA page_size;", sValue, sizeof(sValue));
+		ut_check(ios == SQLITE_OK, "page size: %d", ios);
+
+		spC=calloc(1, sizeof(struct fa_sql_ckpt_lun));
+		ut_check(spC != 0, "checkpoint alloc");
+		spC->iLun=spDB->iLun;
+		spC->sPolicy=*spDB->spCkpt;
+		if (spC->sPolicy.iWalMin == 0) spC->sPolicy.iWalMin=FA_CKPT_WAL_MIN_IV0;
+		if (spC->sPolicy.iWalMax == 0) spC->sPolicy.iWalMax=FA_CKPT_WAL_MAX_IV0;
+		if (spC->sPolicy.iIdleMs == 0) spC->sPolicy.iIdleMs=FA_CKPT_IDLE_MS_IV0;
+		if (spC->sPolicy.iPollMs <= 0) spC->sPolicy.iPollMs=FA_CKPT_POLL_MS_IV0;
+		spC->iFrameBytes=atoi(sValue)+24;		// page plus WAL frame header
+
+		ios=sqlite3_open(sqlite3_db_filename(fa_lun[spDB->iLun].db, "main"), &spC->db);
+		if (ios != SQLITE_OK)
+		  {
+			sqlite3_close(spC->db);
+			free(spC);
+			ut_error("checkpoint open: %d", ios);
+			goto error;
+		  }
+		sqlite3_busy_timeout(spC->db, spC->sPolicy.iPollMs);	// briefly wait for writers with RESTART/TRUNCATE
+
+		pthread_mutex_init(&spC->sLock, 0);
+		pthread_cond_init(&spC->sWake, 0);
+		if (pthread_create(&spC->tid, 0, fa_sql_checkpoint_thread, spC) != 0)
+		  {
+			sqlite3_close(spC->db);
+			free(spC);
+			ut_error("checkpoint thread");
+			goto error;
+		  }
+		spSched[spDB->iLun]=spC;
+		sqlite3_wal_hook(fa_lun[spDB->iLun].db, fa_sql_checkpoint_wal, spC);	// replaces auto-checkpoint
+	  }
+
+	return 0;
+
+error:
+	return -1;
+  }
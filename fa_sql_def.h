@@ -33,6 +33,31 @@
 
 #define	FA_BUFFER_S0	500			// Max size of buffers to hold SQL scripts
 
+#define	FA_BUSY_MS_IV0		5000	// Default ms to wait on a locked database
+#define	FA_BUSY_RETRY_IV0	3		// Default statement retries once the busy wait has expired
+#define	FA_BUSY_BACKOFF_IV0	100		// Max ms between busy retries
+
+#define	FA_CKPT_PASSIVE		0		// Checkpoint modes for fa_sql_checkpoint, same values as SQLITE_CHECKPOINT_*
+#define	FA_CKPT_FULL		1		//	passive doesn't wait on readers or writers, full waits for writers,
+#define	FA_CKPT_RESTART		2		//	restart also waits for readers so the WAL restarts from the beginning
+#define	FA_CKPT_TRUNCATE	3		//	and truncate then truncates the WAL file to zero bytes
+#define	FA_CKPT_WAL_MIN_IV0	1048576	// Default WAL bytes to checkpoint at once the database is idle
+#define	FA_CKPT_WAL_MAX_IV0	16777216	// Default WAL bytes to checkpoint at even if the database is busy
+#define	FA_CKPT_IDLE_MS_IV0	50		// Default ms without calls for a database to count as idle
+#define	FA_CKPT_POLL_MS_IV0	100		// Default ms between WAL size checks
+
+					// Policy for background WAL checkpoints by fa_sql_checkpoint
+struct fa_sql_ckpt
+  {
+    int		iMode;						// FA_CKPT_PASSIVE, FA_CKPT_FULL, FA_CKPT_RESTART or FA_CKPT_TRUNCATE
+    int		iWalMin;					// WAL bytes not yet checkpointed to checkpoint at once idle,
+										//	0 for FA_CKPT_WAL_MIN_IV0
+    int		iWalMax;					// WAL bytes not yet checkpointed to checkpoint at regardless,
+										//	0 for FA_CKPT_WAL_MAX_IV0
+    int		iIdleMs;					// ms without calls to count as idle, 0 for FA_CKPT_IDLE_MS_IV0 or -1 to not wait
+    int		iPollMs;					// ms between WAL size checks, 0 for FA_CKPT_POLL_MS_IV0
+  };
+
 					// Definitions for each database
 struct fa_sql_db
   {
@@ -44,6 +69,10 @@ struct fa_sql_db
 	int		iLun;							// Allocated index number for fa_sql_lun.h where db/statement handles are held
     struct 	fa_sql_table *spTab;			// pointer to start of sql_table array
     char	sKey[FA_KEY_M0][FA_KEY_S0];		// null terminated SQL key string
+    int		iBusyMs;						// ms to wait on a locked database, 0 for FA_BUSY_MS_IV0 or -1 for none
+    int		iBusyRetry;						// statement retries after waiting, 0 for FA_BUSY_RETRY_IV0 or -1 for none
+    struct	fa_sql_ckpt *spCkpt;			// background checkpoint policy or 0 to leave it to sqlite's auto-checkpoint
+											//	the database must already be in WAL mode to use one
   };
 
 					// Definitions for each database table
@@ -54,6 +83,12 @@ struct fa_sql_table
     int		iCol;						// Column count per table
 	int		bmField;					// bitmap of selected columns	#TODO will need to be an array for larger tables
     struct	fa_sql_column *spCol;		// pointer to start of sql_column array
+    char	*cpJoin;					// null terminated LEFT JOIN condition to link this table to earlier selected
+										//	tables i.e. "b.parent = a.id" or 0 if not joinable
+    int		(*fpUnpack)(void *, int);	// optional specialised row unpacker generated by fa_schema_gen or 0
+										//	passed a prepared statement and bmField, returns columns unpacked
+    int		(*fpWrite)(void *, int);	// optional specialised INSERT value binder generated by fa_schema_gen or 0
+										//	passed fa_sql_handler's prepared INSERT and bmField, returns 0 if ok
   };
 
 					// Definitions for each database table column
@@ -67,9 +102,51 @@ struct fa_sql_column
     int		iSize;						// Size of data to unpack - max column size
   };
 
+					// Library wide performance counters, for monitoring
+struct fa_sql_stats
+  {
+    long	lBusy;						// SQLITE_BUSY results after any busy wait
+    long	lBusyWait;					// busy waits on a database locked by another process/connection
+    long	lBusyWaitMs;				// total ms spent in busy waits and retry backoffs
+    long	lRetry;						// statements retried after SQLITE_BUSY
+    long	lBusyFail;					// calls failed with SQLITE_BUSY despite waiting and retrying
+    long	lCkpt;						// background WAL checkpoints completed
+    long	lCkptFail;					// background WAL checkpoints that were busy, to be tried again
+    long	lCkptUs;					// total us spent in background WAL checkpoints
+    long	lCkptMaxUs;					// longest background WAL checkpoint in us
+    long	lWalBytes;					// WAL bytes not yet checkpointed, as last seen by the checkpoint scheduler
+  };
+extern struct fa_sql_stats fa_sql_stats;
+#define	FA_STATS_ADD(field, n)	__atomic_add_fetch(&fa_sql_stats.field, (n), __ATOMIC_RELAXED)
+
+					// Keys for a batched lookup by FA_READ+FA_BATCH, passed to fa_handler in place of an SQL key
+struct fa_sql_batch
+  {
+    char	*cpCol;						// key column with its table alias i.e. "a.id"
+    int		iKeys;						// number of keys
+    void	*vpKeys;					// array of int keys, or of null terminated string keys iSize bytes apart
+    int		iSize;						// 0 for int keys, else size of each string key
+    int		iMatch;						// set by each FA_STEP to the index of the key the row matched
+  };
+
+					// A committed change to a table, delivered by fa_sql_feed
+struct fa_sql_change
+  {
+    char	sTable[FA_TABLE_NAME_S0];	// null terminated SQL table name, or empty for FA_RESET
+    int		iOp;						// FA_WRITE, FA_UPDATE, FA_DELETE or FA_RESET if unknown changes were made
+    long long	lRowid;					// rowid of the row changed
+  };
+typedef void (*fa_sql_feed_fn)(struct fa_sql_change*, int, void*);	// change feed callback
+
 int fa_handler(const int, struct fa_sql_db*, char*);				// generic file/db handler
 int fa_sql_generator(const int, struct fa_sql_db*, char*, char*);	// for building SQL scripts
 int fa_sql_generator_key(char*, struct fa_sql_db*, int*, char*, int);	// for building SQL SELECT key scripts
 int fa_sql_handler(const int, char*, struct fa_sql_db*);			// for passing SQL scripts to the SQL engine
+int fa_sql_bulk(const int, char*, struct fa_sql_db*);				// for streaming a table to/from a file
+int fa_sql_feed(const int, struct fa_sql_db*, fa_sql_feed_fn, void*);	// for subscribing to changes
+int fa_sql_feed_read(struct fa_sql_db*, struct fa_sql_change*, int);	// for reading queued changes
+int fa_sql_feed_poll(struct fa_sql_db*);							// for detecting changes by other processes
+void fa_sql_feed_flush(int);										// for delivering committed changes
+int fa_sql_checkpoint(const int, struct fa_sql_db*);				// for background WAL checkpoints
 
 #endif
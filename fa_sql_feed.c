@@ -0,0 +1,328 @@
+//--------------------------------------------------------------
+//
+// Change feed - deliver batches of committed changes to an open database's tables, rather than polling them
+//
+//	usage:	status = fa_sql_feed(action, database-definition, callback, argument)
+//		where:-	action is FA_OPEN to subscribe to changes or FA_CLOSE to unsubscribe
+//				database-definition points to an open database's definitions
+//				callback is called as callback(changes, count, argument) with each committed batch of changes
+//					or 0 to queue changes for fa_sql_feed_read instead
+//				argument is passed on to the callback
+//		returns 0 if ok, else -1
+//
+//			count = fa_sql_feed_read(database-definition, changes, max)
+//		reads up to max queued changes into the changes array, returning how many were read.
+//			The queue is lock-free so may be read by a different thread to those writing to the database.
+//
+//			status = fa_sql_feed_poll(database-definition)
+//		checks if another process or connection has committed changes since the last poll, using
+//			PRAGMA data_version. Returns 1 and delivers an FA_RESET change if so (the tables and rows
+//			changed aren't known so consumers should re-read), else 0.
+//
+//			fa_sql_feed_flush(lun)
+//		is called by fa_sql_handler after each command, and fa_sql_bulk after each batch, to deliver
+//			changes once they are committed.
+//
+// Changes made through this lun are collected by sqlite's update hook. Its commit hook moves them to a
+//	list of committed changes, to be delivered by the next flush. The COMMIT is seen to have completed
+//	when the next flush or statement (using a statement trace) finds no transaction open. Its rollback
+//	hook drops only the changes of the transaction rolled back - those still being collected and any from
+//	a COMMIT that failed - so changes already committed are still delivered. Each change holds the
+//	table, the action (FA_WRITE, FA_UPDATE or FA_DELETE) and the rowid. If more changes are made than can be
+//	held then they are replaced by one FA_RESET change.
+// While subscribed an authorizer turns off sqlite's truncate optimisation, so an unfiltered DELETE FROM
+//	a table still reports each row deleted. Rows deleted by ON CONFLICT REPLACE are not reported - only
+//	the row that replaced them.
+// Callbacks must not write to the database.
+//
+//	GNU GPLv3 licence	libgxtfa by Andrew Bennington 2017 [www.benningtons.net]
+//
+//--------------------------------------------------------------
+
+#include <pthread.h>		//producer lock
+#include <sqlite3.h>		//used for database application interface calls
+#include <stdint.h>			//intptr_t for passing luns to hooks
+#include <stdio.h>			//standard I/O
+#include <stdlib.h>			//memory allocation
+#include <string.h>			//string functions such as strcmp
+
+
+#include <fa_def.h>			//filehandler actions
+#include <fa_lun.h>			//table of file/database and prepared command handles
+#include <fa_sql_def.h>		//format for holding details of any SQL database to enable unpacking of data
+#include <ut_error.h>		//error and debug functions
+
+#define	FA_FEED_M0			256			// Max changes per committed batch before replacing with FA_RESET
+#define	FA_FEED_QUEUE_M0	1024		// Size of queue for fa_sql_feed_read - must be a power of 2
+
+struct fa_sql_feed_lun					// a subscription to a lun's changes
+  {
+	fa_sql_feed_fn fpFn;				// callback or 0 to queue
+	void	*vpArg;						// callback argument
+	pthread_mutex_t sLock;				// held by writers collecting and delivering changes
+	int		iPending;					// changes collected in the current transaction
+	struct	fa_sql_change sPending[FA_FEED_M0];
+	int		iDone;						// committed changes waiting to be delivered
+	int		iInflight;					//	the last of which are from a COMMIT not yet seen to complete
+	struct	fa_sql_change sDone[FA_FEED_M0];
+	sqlite3_stmt *spVersion;			// PRAGMA data_version
+	int		iVersion;					// last data_version seen
+	unsigned int iHead;					// queue written by writers
+	unsigned int iTail;					//	and read by fa_sql_feed_read
+	int		iLost;						// set if changes were lost to a full queue
+	struct	fa_sql_change sQueue[FA_FEED_QUEUE_M0];
+  };
+
+static struct fa_sql_feed_lun *spFeed[FA_LUN_M0];	// subscriptions by lun
+
+
+static void fa_sql_feed_add(struct fa_sql_change *spList, int *ipCount,
+							const char *cpTable, int iOp, long long lRowid)
+  {														// add a change to a list, caller holds sLock
+	if (*ipCount >= FA_FEED_M0)							// too many to hold so just report a reset
+	  {
+		*ipCount=0;
+		cpTable="";
+		iOp=FA_RESET;
+		lRowid=0;
+	  }
+	else if (*ipCount == 1 && spList[0].iOp == FA_RESET)
+		return;											// already reporting a reset
+
+	snprintf(spList[*ipCount].sTable, FA_TABLE_NAME_S0, "%s", cpTable);
+	spList[*ipCount].iOp=iOp;
+	spList[(*ipCount)++].lRowid=lRowid;
+  }
+
+
+static void fa_sql_feed_update(void *vpLun, int iOp, const char *cpDb, const char *cpTable, sqlite3_int64 lRowid)
+  {														// sqlite update hook
+	struct fa_sql_feed_lun *spF = spFeed[(intptr_t) vpLun];
+
+	if (strcmp(cpDb, "temp") == 0) return;				// private to this connection so not of interest
+
+	pthread_mutex_lock(&spF->sLock);
+	fa_sql_feed_add(spF->sPending,
+					&spF->iPending,
+					cpTable,
+					(iOp == SQLITE_INSERT) ? FA_WRITE : (iOp == SQLITE_UPDATE) ? FA_UPDATE : FA_DELETE,
+					lRowid);
+	pthread_mutex_unlock(&spF->sLock);
+  }
+
+
+static int fa_sql_feed_commit(void *vpLun)				// sqlite commit hook
+  {
+	struct fa_sql_feed_lun *spF = spFeed[(intptr_t) vpLun];
+	int i;
+
+	pthread_mutex_lock(&spF->sLock);					// move this transaction's changes to the committed list
+	for (i=0; i < spF->iPending; i++)
+	  {
+		fa_sql_feed_add(spF->sDone, &spF->iDone, spF->sPending[i].sTable, spF->sPending[i].iOp,
+						spF->sPending[i].lRowid);
+		if (spF->iDone == 1 && spF->sDone[0].iOp == FA_RESET)
+			spF->iInflight=0;							// a reset stands even if the commit fails
+		else
+			spF->iInflight++;
+	  }
+	spF->iPending=0;
+	pthread_mutex_unlock(&spF->sLock);
+	return 0;											// allow the commit
+  }
+
+
+static int fa_sql_feed_stmt(unsigned int iType, void *vpLun, void *vpStmt, void *vpSQL)
+  {														// sqlite statement trace, as each statement starts
+	struct fa_sql_feed_lun *spF = spFeed[(intptr_t) vpLun];
+
+	if (spF->iInflight != 0 && sqlite3_get_autocommit(sqlite3_db_handle(vpStmt)))
+	  {
+		pthread_mutex_lock(&spF->sLock);
+		spF->iInflight=0;								// last COMMIT completed so keep its changes
+		pthread_mutex_unlock(&spF->sLock);
+	  }
+	return 0;
+  }
+
+
+static int fa_sql_feed_auth(void *vpLun, int iAction, const char *cp1, const char *cp2,
+							const char *cpDb, const char *cpTrigger)	// sqlite authorizer, as statements are prepared
+  {
+	return (iAction == SQLITE_DELETE) ? SQLITE_IGNORE : SQLITE_OK;	// DELETE each row so the update hook sees it
+  }
+
+
+static void fa_sql_feed_rollback(void *vpLun)			// sqlite rollback hook
+  {
+	struct fa_sql_feed_lun *spF = spFeed[(intptr_t) vpLun];
+
+	pthread_mutex_lock(&spF->sLock);
+	spF->iPending=0;									// this transaction's changes never happened
+	spF->iDone-=spF->iInflight;							//	nor did any from a COMMIT that failed
+	spF->iInflight=0;
+	pthread_mutex_unlock(&spF->sLock);
+  }
+
+
+static void fa_sql_feed_deliver(struct fa_sql_feed_lun *spF, struct fa_sql_change *spC, int iCount)
+  {														// pass changes to callback or queue
+	unsigned int iHead;
+	int i;
+
+	if (spF->fpFn != 0)
+	  {
+		spF->fpFn(spC, iCount, spF->vpArg);
+		return;
+	  }
+
+	iHead=spF->iHead;									// only writers, holding sLock, move the head
+	for (i=0; i < iCount; i++)
+	  {
+		if (iHead-__atomic_load_n(&spF->iTail, __ATOMIC_ACQUIRE) >= FA_FEED_QUEUE_M0)
+		  {
+			__atomic_store_n(&spF->iLost, 1, __ATOMIC_RELEASE);	// queue full so reader must re-read
+			break;
+		  }
+		spF->sQueue[iHead % FA_FEED_QUEUE_M0]=spC[i];
+		iHead++;
+	  }
+	__atomic_store_n(&spF->iHead, iHead, __ATOMIC_RELEASE);
+  }
+
+
+void fa_sql_feed_flush(int iLun)
+  {
+	struct fa_sql_feed_lun *spF = spFeed[iLun];
+	struct fa_sql_change sBatch[FA_FEED_M0];			// copied so callbacks run without holding sLock
+	int iCount = 0;
+
+	if (spF == 0 || spF->iDone == 0) return;
+	if (!sqlite3_get_autocommit(fa_lun[iLun].db)) return;	// commit failed so transaction still open
+
+	pthread_mutex_lock(&spF->sLock);
+	if (spF->fpFn != 0)
+	  {
+		iCount=spF->iDone;
+		memcpy(sBatch, spF->sDone, iCount*sizeof(struct fa_sql_change));
+	  }
+	else
+		fa_sql_feed_deliver(spF, spF->sDone, spF->iDone);
+	spF->iDone=0;
+	spF->iInflight=0;									// commit completed
+	pthread_mutex_unlock(&spF->sLock);
+
+	if (iCount > 0) fa_sql_feed_deliver(spF, sBatch, iCount);
+  }
+
+
+int fa_sql_feed(const int iAction, struct fa_sql_db *spDB, fa_sql_feed_fn fpFn, void *vpArg)
+  {
+	struct fa_sql_feed_lun *spF = spFeed[spDB->iLun];
+	int ios = SQLITE_OK;
+
+	if (spF != 0)										// drop any current subscription
+	  {
+		sqlite3_update_hook(fa_lun[spDB->iLun].db, 0, 0);
+		sqlite3_commit_hook(fa_lun[spDB->iLun].db, 0, 0);
+		sqlite3_rollback_hook(fa_lun[spDB->iLun].db, 0, 0);
+		sqlite3_trace_v2(fa_lun[spDB->iLun].db, 0, 0, 0);
+		sqlite3_set_authorizer(fa_lun[spDB->iLun].db, 0, 0);
+		sqlite3_finalize(spF->spVersion);
+		pthread_mutex_destroy(&spF->sLock);
+		spFeed[spDB->iLun]=0;
+		free(spF);
+	  }
+
+	if (iAction & FA_OPEN)
+	  {
+		spF=calloc(1, sizeof(struct fa_sql_feed_lun));
+		ut_check(spF != 0, "feed alloc");
+		spF->fpFn=fpFn;
+		spF->vpArg=vpArg;
+		pthread_mutex_init(&spF->sLock, 0);
+
+		ios=sqlite3_prepare_v2(fa_lun[spDB->iLun].db, "PRAGMA data_version;", -1, &spF->spVersion, 0);
+		if (ios == SQLITE_OK && (ios=sqlite3_step(spF->spVersion)) == SQLITE_ROW)
+		  {
+			spF->iVersion=sqlite3_column_int(spF->spVersion, 0);	// starting point for fa_sql_feed_poll
+			ios=sqlite3_reset(spF->spVersion);
+		  }
+		if (ios != SQLITE_OK)
+		  {
+			sqlite3_finalize(spF->spVersion);
+			free(spF);
+			ut_error("feed version: %s", sqlite3_errmsg(fa_lun[spDB->iLun].db));
+			goto error;
+		  }
+
+		spFeed[spDB->iLun]=spF;
+		sqlite3_update_hook(fa_lun[spDB->iLun].db, fa_sql_feed_update, (void *)(intptr_t) spDB->iLun);
+		sqlite3_commit_hook(fa_lun[spDB->iLun].db, fa_sql_feed_commit, (void *)(intptr_t) spDB->iLun);
+		sqlite3_rollback_hook(fa_lun[spDB->iLun].db, fa_sql_feed_rollback, (void *)(intptr_t) spDB->iLun);
+		sqlite3_trace_v2(	fa_lun[spDB->iLun].db, SQLITE_TRACE_STMT, fa_sql_feed_stmt,
+							(void *)(intptr_t) spDB->iLun);
+		sqlite3_set_authorizer(fa_lun[spDB->iLun].db, fa_sql_feed_auth, (void *)(intptr_t) spDB->iLun);
+	  }
+
+	return 0;
+
+error:
+	return -1;
+  }
+
+
+int fa_sql_feed_read(struct fa_sql_db *spDB, struct fa_sql_change *spO, int iMax)
+  {
+	struct fa_sql_feed_lun *spF = spFeed[spDB->iLun];
+	unsigned int iTail, iHead;
+	int i = 0;
+
+	if (spF == 0) return 0;
+
+	if (__atomic_exchange_n(&spF->iLost, 0, __ATOMIC_ACQ_REL) && iMax > 0)
+	  {													// changes lost so tell the reader to re-read
+		spO[i].sTable[0]=0;
+		spO[i].iOp=FA_RESET;
+		spO[i++].lRowid=0;
+	  }
+
+	iTail=spF->iTail;									// only the reader moves the tail
+	iHead=__atomic_load_n(&spF->iHead, __ATOMIC_ACQUIRE);
+	while (iTail != iHead && i < iMax)
+		spO[i++]=spF->sQueue[iTail++ % FA_FEED_QUEUE_M0];
+	__atomic_store_n(&spF->iTail, iTail, __ATOMIC_RELEASE);
+
+	return i;
+  }
+
+
+int fa_sql_feed_poll(struct fa_sql_db *spDB)
+  {
+	struct fa_sql_feed_lun *spF = spFeed[spDB->iLun];
+	struct fa_sql_change sChange;
+	int iVersion;
+	int ios;
+
+	ut_check(spF != 0, "not subscribed");
+
+	ios=sqlite3_step(spF->spVersion);
+	ut_check(ios == SQLITE_ROW, "data_version: %d", ios);
+	iVersion=sqlite3_column_int(spF->spVersion, 0);
+	sqlite3_reset(spF->spVersion);
+
+	if (iVersion == spF->iVersion) return 0;			// nothing changed elsewhere
+
+	spF->iVersion=iVersion;
+	sChange.sTable[0]=0;
+	sChange.iOp=FA_RESET;
+	sChange.lRowid=0;
+	pthread_mutex_lock(&spF->sLock);
+	if (spF->fpFn == 0) fa_sql_feed_deliver(spF, &sChange, 1);
+	pthread_mutex_unlock(&spF->sLock);
+	if (spF->fpFn != 0) fa_sql_feed_deliver(spF, &sChange, 1);
+	return 1;
+
+error:
+	return -1;
+  }
@@ -2,12 +2,25 @@
 //
 // Generate SQL scripts based on a bitmap of actions and a bitmap of tables/columns to work with
 //
+// SELECTs use every table with selected columns. The 1st is the FROM table and the others are LEFT JOINed
+//	to it using their table's JOIN condition, so rows are still returned where there are no matching rows
+//	in the other tables. Their columns are then NULL, which fa_sql_handler unpacks as 0 for int and char
+//	columns and an empty string for blob columns. Other actions only work on the 1st selected table.
+//
+// FA_READ+FA_BATCH looks up a batch of keys in one SELECT. The key is then a struct fa_sql_batch and its keys,
+//	loaded into the temp table fa_batch by fa_sql_handler, are JOINed to the key column of the 1st table.
+//	The index of the key each row matched is returned as the 1st column (ibatch) with rows in key order,
+//	after any DISTINCT. All of a table's columns are read as alias.* so fa_batch's columns aren't returned.
+//
+// FA_WRITE+FA_UPDATE is an upsert - an INSERT that UPDATEs the selected columns instead if a row with the
+//	same primary key (FA_COL_PRIME_B0 columns) already exists. Uses ON CONFLICT so needs sqlite 3.24+.
+//
 //	usage:	status = fa_sql_generator (action, db, key, output)
 //		where	action is a bitmap of filehandler commands - see fa_def.h
 //				db is a structure pointer to database definition data
 //				key is a pointer to any SQL script passed, which will be used as a key descriptor
 //				output is a pointer to an output buffer containing the generated SQL script
-//					the max buffer size is set by FA_BUFFER_S0 in fa_sql_def.h
+//					the max buffer size is set by FA_BUFFER_S0 in fa_sql_def.h, longer scripts fail with "SQL too long"
 //		returns 0 if ok, else -1
 //
 //	See fa_sql_def.h for database definition structures
@@ -32,10 +45,17 @@ int fa_sql_generator(int iAction, struct fa_sql_db *spDb, char *cpPKey, char *cp
   {
     struct fa_sql_column *spCol;					// pointer to sql column definitions
     struct fa_sql_table *spTab;						// pointer to sql table definitions
+    struct fa_sql_table *spJoin;					// pointer to further tables to JOIN when reading
+    struct fa_sql_table *spTabEnd;					// end of the db's table array
 
     int iBuffMax = FA_BUFFER_S0;					// max buffer size
     int i, j;
+    int iJoin;										// count of further tables to JOIN when reading
+    int iAll;										// set if reading all columns with SELECT *
+    int iUpsert;									// set if writing a row or updating it if already there
+    char *cpSet;									// start of an upsert's list of columns to UPDATE
     char *cpKey = &spDb->sKey[iAction & FA_KEY_MASK][0];		// pointer to sql key definitions
+    struct fa_sql_batch *spBatch = (struct fa_sql_batch *) cpPKey;	// keys passed for an FA_BATCH
 
     spTab=spDb->spTab;								// start pointing to 1st table in db
     i=0;
@@ -49,9 +69,39 @@ int fa_sql_generator(int iAction, struct fa_sql_db *spDb, char *cpPKey, char *cp
 
 	if (iAction & FA_READ)						// Prepare SQL to SELECT from db
 	  {
+		spTabEnd=spDb->spTab+spDb->iTab;		// end of this db's table array
+		iJoin=0;
+		for (spJoin=spTab+1; spJoin < spTabEnd; spJoin++)	// any further tables to JOIN to the 1st?
+			if (spJoin->bmField != 0) iJoin++;
+
+		iAll=(spTab->bmField == FA_ALL_COLS_B0 && iJoin == 0 &&	// SELECT * for all of one table's columns
+			spTab->fpUnpack == 0 &&				// but specialised unpackers need columns in their listed order
+			!(iAction & FA_BATCH));				// and * would also return fa_batch's columns
+
 		j=snprintf(cpO, iBuffMax, "SELECT ");
 		cpO+=j;									// step through the output buffer
 		iBuffMax-=j;							// whilst reducing the remaining buffer space
+		ut_check(iBuffMax > 0, "SQL too long");	// will jump to error: if the buffer is full
+
+		if (iAction & FA_DISTINCT && !(iAction & FA_COUNT) && !iAll)
+		  {										// SELECT DISTINCT i.e. only return distinct (different) values
+			j=snprintf(	cpO,
+						iBuffMax,
+						"DISTINCT ");
+			cpO+=j;
+			iBuffMax-=j;
+			ut_check(iBuffMax > 0, "SQL too long");
+		  }
+
+		if (iAction & FA_BATCH)					// mark each row with the key it matched
+		  {
+			j=snprintf(	cpO,
+						iBuffMax,
+						"fab.n AS ibatch, ");
+			cpO+=j;
+			iBuffMax-=j;
+			ut_check(iBuffMax > 0, "SQL too long");
+		  }
 
 		if (iAction & FA_COUNT)					// SELECT COUNT(*) i.e. count matching rows
 		  {
@@ -60,8 +110,9 @@ int fa_sql_generator(int iAction, struct fa_sql_db *spDb, char *cpPKey, char *cp
 						"COUNT(*) AS icount ");
 			cpO+=j;
 			iBuffMax-=j;
+			ut_check(iBuffMax > 0, "SQL too long");
 		  }
-		else if (spTab->bmField == FA_ALL_COLS_B0)
+		else if (iAll)
 		  {
 			snprintf(cpO, iBuffMax, "*");
 			cpO++;
@@ -69,54 +120,103 @@ int fa_sql_generator(int iAction, struct fa_sql_db *spDb, char *cpPKey, char *cp
 		  }
 		else
 		  {
-			if (iAction & FA_DISTINCT)				// SELECT DISTINCT i.e. only return distinct (different) values
-			  {
-				j=snprintf(	cpO,
-							iBuffMax,
-							"DISTINCT ");
-				cpO+=j;
-				iBuffMax-=j;
-			  }
-
-			spCol=spTab->spCol;
-			for (i=0; i < spTab->iCol; i++)			// List columns to SELECT
+			for (spJoin=spTab; spJoin < spTabEnd; spJoin++)	// List columns to SELECT from each selected table
 			  {
-				if ((spTab->bmField>>i) & 1)
+				if (spJoin->bmField == FA_ALL_COLS_B0 && spJoin->fpUnpack == 0)
 				  {
 					j=snprintf(	cpO,
 								iBuffMax,
-								"%s.%s, ",
-								spTab->sAlias,		// Table alias
-								spCol->sName);		// Column name
+								"%s.*, ",
+								spJoin->sAlias);	// All of this table's columns
 					cpO+=j;
 					iBuffMax-=j;
+					ut_check(iBuffMax > 0, "SQL too long");
+					continue;
+				  }
+
+				spCol=spJoin->spCol;
+				for (i=0; i < spJoin->iCol; i++)
+				  {
+					if ((spJoin->bmField>>i) & 1)
+					  {
+						j=snprintf(	cpO,
+									iBuffMax,
+									"%s.%s, ",
+									spJoin->sAlias,	// Table alias
+									spCol->sName);	// Column name
+						cpO+=j;
+						iBuffMax-=j;
+						ut_check(iBuffMax > 0, "SQL too long");
+					  }
+					spCol++;
 				  }
-				spCol++;
 			  }
 			cpO-=2;									// reverse back over the last ", "
 			iBuffMax+=2;
 		  }
 
-		j=snprintf(	cpO,
-					iBuffMax,
-					" FROM %s AS %s WHERE ",
-					spTab->sName,
-					spTab->sAlias);
+		if (iAction & FA_BATCH)					// drive the SELECT from the batch's keys
+			j=snprintf(	cpO,
+						iBuffMax,
+						" FROM temp.fa_batch AS fab JOIN %s AS %s ON %s = fab.v",
+						spTab->sName,
+						spTab->sAlias,
+						spBatch->cpCol);
+		else
+			j=snprintf(	cpO,
+						iBuffMax,
+						" FROM %s AS %s",
+						spTab->sName,
+						spTab->sAlias);
 		cpO+=j;
 		iBuffMax-=j;
+		ut_check(iBuffMax > 0, "SQL too long");
+
+		for (spJoin=spTab+1; spJoin < spTabEnd; spJoin++)	// JOIN any other selected tables
+		  {
+			if (spJoin->bmField == 0) continue;
+
+			ut_check(	spJoin->cpJoin != 0,		// Must know how to link this table to the others
+						"no join for %s", spJoin->sName);
+			j=snprintf(	cpO,
+						iBuffMax,
+						" LEFT JOIN %s AS %s ON %s",
+						spJoin->sName,
+						spJoin->sAlias,
+						spJoin->cpJoin);
+			cpO+=j;
+			iBuffMax-=j;
+			ut_check(iBuffMax > 0, "SQL too long");
+		  }
+
+		if (iAction & FA_BATCH)						// keys come from the JOIN so just keep them in order
+		  {
+			j=snprintf(	cpO,
+						iBuffMax,
+						"%s ORDER BY fab.n;",
+						(iAction & FA_COUNT) ? " GROUP BY fab.n" : "");	// a count per key
+		  }
+		else
+		  {
+			j=snprintf(cpO, iBuffMax, " WHERE ");
+			cpO+=j;
+			iBuffMax-=j;
+			ut_check(iBuffMax > 0, "SQL too long");
 
-		if (cpPKey != 0) cpKey=cpPKey;				// use the passed key rather than any specified by FA_KEYx
+			if (cpPKey != 0) cpKey=cpPKey;			// use the passed key rather than any specified by FA_KEYx
 
-		cpO+=fa_sql_generator_key(	cpKey,			// selected key details
-									spDb,			// selected database details
-									&iBuffMax,		// remaining output buffer
-									cpO,			// output buffer
-									TRUE);			// use table aliases on all columns
+			cpO+=fa_sql_generator_key(	cpKey,		// selected key details
+										spDb,		// selected database details
+										&iBuffMax,	// remaining output buffer
+										cpO,		// output buffer
+										TRUE);		// use table aliases on all columns
+			ut_check(iBuffMax > 0, "SQL too long");
 
-		j=snprintf(cpO, iBuffMax, ";");
+			j=snprintf(cpO, iBuffMax, ";");
+		  }
 	  }
 
-	else if (iAction & FA_UPDATE)					// UPDATE a row in the database
+	else if ((iAction & (FA_UPDATE+FA_WRITE)) == FA_UPDATE)	// UPDATE a row in the database
 	  {												// #TODO may be better to update changed fields only?
 		j=snprintf(cpO, iBuffMax, "UPDATE %s SET ", spTab->sName);
 		cpO+=j;										// step through the output buffer
@@ -163,7 +263,8 @@ int fa_sql_generator(int iAction, struct fa_sql_db *spDb, char *cpPKey, char *cp
 	  }
 
 	else if (iAction & FA_WRITE)				// INSERT a row into the database
-      {
+      {											//	or with FA_UPDATE then INSERT or UPDATE if it exists
+		iUpsert=((iAction & FA_UPDATE) != 0);
 		j=snprintf(cpO, iBuffMax, "INSERT INTO %s (", spTab->sName);
 		cpO+=j;									// step through the output buffer
 		iBuffMax-=j;							// whilst reducing the remaining buffer space
@@ -171,8 +272,9 @@ int fa_sql_generator(int iAction, struct fa_sql_db *spDb, char *cpPKey, char *cp
 		spCol=spTab->spCol;
 		for (i=0; i < spTab->iCol; i++)
 		  {
-			if (((spTab->bmField>>i) & 1) && !(spCol->bmFlag & FA_COL_AUTO_B0))
-			  {									// Don't try writing to any auto-generated columns
+			if (((spTab->bmField>>i) & 1) &&	// Don't try writing to any auto-generated columns
+				(!(spCol->bmFlag & FA_COL_AUTO_B0) || (iUpsert && spCol->bmFlag & FA_COL_PRIME_B0)))
+			  {									//	unless they're primary keys needed for an upsert
 				j=snprintf(cpO, iBuffMax, "%s, ", spCol->sName);	// output list of selected field names
 				cpO+=j;
 				iBuffMax-=j;
@@ -189,8 +291,9 @@ int fa_sql_generator(int iAction, struct fa_sql_db *spDb, char *cpPKey, char *cp
 		spCol=spTab->spCol;
 		for (i=0; i < spTab->iCol; i++)
 		  {
-			if (((spTab->bmField>>i) & 1) && !(spCol->bmFlag & FA_COL_AUTO_B0))
-			  {								// Don't try writing to any auto-generated columns
+			if (((spTab->bmField>>i) & 1) &&	// Don't try writing to any auto-generated columns
+				(!(spCol->bmFlag & FA_COL_AUTO_B0) || (iUpsert && spCol->bmFlag & FA_COL_PRIME_B0)))
+			  {
 				if (spCol->bmFlag & FA_COL_INT_B0)
 					j=snprintf(cpO, iBuffMax, "%d, ", *(int *)spCol->cpPos);
 				else if (spCol->bmFlag & FA_COL_CHAR_B0)
@@ -207,7 +310,64 @@ int fa_sql_generator(int iAction, struct fa_sql_db *spDb, char *cpPKey, char *cp
 		cpO-=2;								// reverse back over the last ", "
 		iBuffMax+=2;
 
-		cpO+=snprintf(cpO, iBuffMax, ");");
+		cpO+=snprintf(cpO, iBuffMax, ")");
+		iBuffMax--;
+
+		if (iUpsert)						// upsert so UPDATE if the primary key already exists
+		  {
+			j=snprintf(cpO, iBuffMax, " ON CONFLICT (");
+			cpO+=j;
+			iBuffMax-=j;
+
+			spCol=spTab->spCol;
+			for (i=0; i < spTab->iCol; i++)	// conflict target is the primary key
+			  {
+				if (spCol->bmFlag & FA_COL_PRIME_B0)
+				  {
+					ut_check((spTab->bmField>>i) & 1, "no key %s", spCol->sName);	// must be INSERTed
+					j=snprintf(cpO, iBuffMax, "%s, ", spCol->sName);
+					cpO+=j;
+					iBuffMax-=j;
+				  }
+				spCol++;
+			  }
+			ut_check(*(cpO-1) == ' ', "no primary key");
+			cpO-=2;							// reverse back over the last ", "
+			iBuffMax+=2;
+
+			j=snprintf(cpO, iBuffMax, ") DO UPDATE SET ");
+			cpO+=j;
+			iBuffMax-=j;
+			cpSet=cpO;						// remember where the columns to UPDATE start
+
+			spCol=spTab->spCol;
+			for (i=0; i < spTab->iCol; i++)	// UPDATE the other selected columns
+			  {
+				if (((spTab->bmField>>i) & 1) && !(spCol->bmFlag & (FA_COL_AUTO_B0+FA_COL_PRIME_B0)))
+				  {
+					j=snprintf(cpO, iBuffMax, "%s=excluded.%s, ", spCol->sName, spCol->sName);
+					cpO+=j;
+					iBuffMax-=j;
+				  }
+				spCol++;
+			  }
+
+			if (cpO > cpSet)				// reverse back over the last ", "
+			  {
+				cpO-=2;
+				iBuffMax+=2;
+			  }
+			else							// nothing to update so just keep the existing row
+			  {
+				cpO-=11;					// reverse back over "UPDATE SET "
+				iBuffMax+=11;
+				j=snprintf(cpO, iBuffMax, "NOTHING");
+				cpO+=j;
+				iBuffMax-=j;
+			  }
+		  }
+
+		cpO+=snprintf(cpO, iBuffMax, ";");
 	  }
 
 	else if (iAction & FA_DELETE)			// DELETE a row from the database
@@ -82,6 +82,7 @@ int fa_sql_generator_key(char *cpKey, struct fa_sql_db *spDb, int *iBuffMax, cha
 			cpO+=i;
 			*iBuffMax-=i;
 			iLen+=i;
+			ut_check(*iBuffMax > 0, "SQL too long");	// truncated so don't write past the buffer
 		  }
 
 		if (cpColStart != 0) iColLen++;		// still parsing column name
@@ -15,10 +15,17 @@
 //			FA_RESET	- Reset a PREPARE back to it's start, ready to STEP through again
 //			FA_FINALISE	- Tidily close a PREPARE-STEP-FINALISE loop - other commands will also trigger this
 //			FA_EXEC		- Run an SQL command as a one-off. i.e. PREPARE-STEP-FINALISE in one go
+//			FA_WRITE	- INSERT a row using the table's specialised function generated by fa_schema_gen to bind
+//							its values. The INSERT is prepared once per lun, table and bmField then re-used
+//			FA_BATCH	- Load the keys of the struct fa_sql_batch passed as SQL into the temp table fa_batch
+//							ready for an FA_READ+FA_BATCH to JOIN to
 //			FA_CLOSE	- Close Database
 //
 //	Keeps an index of database and command handles in fa_sql_lun.h
 //
+// A locked database (SQLITE_BUSY) is waited on with an exponential backoff for up to the db's iBusyMs, then
+//	statements are retried up to iBusyRetry times where safe to do so. See fa_sql_stats for counts.
+//
 // Currently SQL commands are based on SQLITE3 but it should be possible to add compiler flags to support other SQL databases.
 //
 //	GNU GPLv3 licence	libgxtfa by Andrew Bennington 2015 [www.benningtons.net]
@@ -26,8 +33,11 @@
 //--------------------------------------------------------------
 
 #include <sqlite3.h>		//used for database application interface calls
+#include <stdint.h>			//intptr_t for passing luns to the busy handler
 #include <stdio.h>			//standard I/O
+#include <stdlib.h>			//rand for backoff jitter
 #include <string.h>			//string functions such as strcmp
+#include <time.h>			//nanosleep and clock_gettime for busy backoff
 
 
 #include <fa_def.h>			//filehandler actions
@@ -35,6 +45,95 @@
 #include <fa_sql_def.h>		//format for holding details of any SQL database to enable unpacking of data
 #include <ut_error.h>		//error and debug functions
 
+struct fa_sql_stats fa_sql_stats;			// library wide performance counters
+
+
+static long fa_sql_us(struct timespec *spStart)	// microseconds since start
+  {
+	struct timespec sNow;
+
+	clock_gettime(CLOCK_MONOTONIC, &sNow);
+	return (sNow.tv_sec-spStart->tv_sec)*1000000L+(sNow.tv_nsec-spStart->tv_nsec)/1000;
+  }
+
+
+static int fa_sql_backoff(int iCount)			// sleep for an exponential backoff, with jitter, returns ms slept
+  {
+	struct timespec sWait;
+	int iMs = 1 << (iCount < 7 ? iCount : 7);	// 1, 2, 4 ... 128ms
+
+	if (iMs > FA_BUSY_BACKOFF_IV0) iMs=FA_BUSY_BACKOFF_IV0;
+	iMs+=rand() % (iMs/2+1);					// jitter so competing processes don't retry in step
+
+	sWait.tv_sec=iMs/1000;
+	sWait.tv_nsec=(iMs%1000)*1000000L;
+	nanosleep(&sWait, 0);
+	return iMs;
+  }
+
+
+static int fa_sql_busy(void *vpLun, int iCount)	// sqlite busy handler - wait for another process's lock
+  {
+	int iLun = (intptr_t) vpLun;
+	int iMs;
+
+	if (iCount == 0) fa_lun[iLun].iBusyWaited=0;	// new lock conflict
+	if (fa_lun[iLun].iBusyWaited >= fa_lun[iLun].iBusyMs) return 0;	// waited long enough so give up
+
+	iMs=fa_sql_backoff(iCount);
+	fa_lun[iLun].iBusyWaited+=iMs;
+	FA_STATS_ADD(lBusyWait, 1);
+	FA_STATS_ADD(lBusyWaitMs, iMs);
+	return 1;
+  }
+
+
+static int fa_sql_retry(int iLun, int iRetry, int iSafe)	// back off and retry after SQLITE_BUSY?
+  {
+	FA_STATS_ADD(lBusy, 1);
+	if (!iSafe || iRetry >= fa_lun[iLun].iBusyRetry)	// can't repeat, or tried enough
+	  {
+		FA_STATS_ADD(lBusyFail, 1);
+		return 0;
+	  }
+
+	FA_STATS_ADD(lRetry, 1);
+	FA_STATS_ADD(lBusyWaitMs, fa_sql_backoff(iRetry+4));	// busy handler has already waited
+	return 1;
+  }
+
+
+static int fa_sql_write_prepare(int iLun, struct fa_sql_table *spTab)	// INSERT for a table's selected columns
+  {
+	char sSQL[FA_BUFFER_S0];
+	char sVal[FA_BUFFER_S0];
+	int iSQL, iVal = 0;
+	int i;
+	int iRetry = 0;
+	int ios;
+
+	iSQL=snprintf(sSQL, FA_BUFFER_S0, "INSERT INTO %s (", spTab->sName);
+	for (i=0; i < spTab->iCol; i++)			// same columns, in the same order, as the generated binder
+		if (((spTab->bmField>>i) & 1) && !(spTab->spCol[i].bmFlag & FA_COL_AUTO_B0))
+		  {
+			iSQL+=snprintf(sSQL+iSQL, FA_BUFFER_S0-iSQL, "%s, ", spTab->spCol[i].sName);
+			iVal+=snprintf(sVal+iVal, FA_BUFFER_S0-iVal, "?, ");
+		  }
+	if (iVal == 0 || iSQL+iVal >= FA_BUFFER_S0) return SQLITE_MISUSE;	// no columns or too many
+	snprintf(sSQL+iSQL-2, FA_BUFFER_S0-iSQL+2, ") VALUES (%.*s);", iVal-2, sVal);
+
+	sqlite3_finalize(fa_lun[iLun].spWrite);		// replace any INSERT for other columns
+	fa_lun[iLun].spWrite=0;
+	while ((ios=sqlite3_prepare_v2(fa_lun[iLun].db, sSQL, -1, &fa_lun[iLun].spWrite, 0)) == SQLITE_BUSY &&
+			fa_sql_retry(iLun, iRetry++, 1));
+	if (ios != SQLITE_OK) return ios;
+
+	ut_debug("fa_write prepared: %s", sSQL);
+	fa_lun[iLun].spWriteTab=spTab;
+	fa_lun[iLun].bmWrite=spTab->bmField;
+	return SQLITE_OK;
+  }
+
 
 int fa_sql_handler(	const int iAction,
 					char *cSQL,
@@ -48,14 +147,35 @@ int fa_sql_handler(	const int iAction,
 	int j, i = 0;
 	int ios = SQLITE_OK;				// SQLITE_OK = 0
 	int iCols;							// Number of columns in a row
+	int iRetry = 0;						// retries after SQLITE_BUSY
+	int iChanges;						// rows changed before an FA_EXEC, to know if it is safe to retry
+	struct fa_sql_batch *spBatch;		// keys to load for FA_BATCH
+	sqlite3_stmt *spIns;				// INSERT of each FA_BATCH key
+	struct timespec sZero = {0, 0};		// clock start, to time-stamp calls for the checkpoint scheduler
 
 
+	if (spDB->spCkpt != 0)				// not idle while a call is running
+		__atomic_store_n(&fa_lun[spDB->iLun].lActive, fa_sql_us(&sZero), __ATOMIC_RELAXED);
 
 	if (iAction & FA_OPEN)				// open database
 	  {
 		ios=sqlite3_open(	cSQL,						// database filename
 							&fa_lun[spDB->iLun].db);	// handle for database - used by other commands
 		ut_check(ios == SQLITE_OK, "open: %d", ios);
+
+		fa_lun[spDB->iLun].iBusyMs=(spDB->iBusyMs != 0) ? spDB->iBusyMs : FA_BUSY_MS_IV0;
+		fa_lun[spDB->iLun].iBusyRetry=(spDB->iBusyRetry != 0) ? spDB->iBusyRetry : FA_BUSY_RETRY_IV0;
+		sqlite3_busy_handler(	fa_lun[spDB->iLun].db,			// wait, rather than fail, if db is locked
+								fa_sql_busy,
+								(void *)(intptr_t) spDB->iLun);
+		if (spDB->spCkpt != 0 &&						// checkpoint in the background, not during commits
+			fa_sql_checkpoint(FA_OPEN, spDB) != 0)
+		  {
+			sqlite3_close(fa_lun[spDB->iLun].db);		// not usable as asked so don't leave it open
+			fa_lun[spDB->iLun].db=0;
+			ios=-1;
+			ut_check(ios == SQLITE_OK, "checkpoint");
+		  }
 	  }
 
 	else if (iAction & FA_FINALISE ||				// Close down a PREPAREd statement (else memory leak)
@@ -72,12 +192,20 @@ int fa_sql_handler(	const int iAction,
 	if (iAction & FA_STEP)							// Step through rows from a previously prepared SELECT
 	  {
 		ut_debug("fa_step");
-		if ((ios=sqlite3_step(fa_lun[spDB->iLun].row)) == SQLITE_ROW)		// Row of data to process
+		while ((ios=sqlite3_step(fa_lun[spDB->iLun].row)) == SQLITE_BUSY &&
+				fa_sql_retry(spDB->iLun, iRetry++, sqlite3_get_autocommit(fa_lun[spDB->iLun].db)));
+
+		if (ios == SQLITE_ROW)								// Row of data to process
 		  {
 			iCols=sqlite3_column_count(fa_lun[spDB->iLun].row);		// how many columns in this row?
 			ut_debug("cols: %d", iCols);
 
 			i=0;
+			if (fa_lun[spDB->iLun].spBatch != 0)	// which key of a batch did this row match?
+				fa_lun[spDB->iLun].spBatch->iMatch=sqlite3_column_int(fa_lun[spDB->iLun].row, i++);
+			if (fa_lun[spDB->iLun].spUnpack != 0)	// use any specialised unpacker generated by fa_schema_gen
+				i=fa_lun[spDB->iLun].spUnpack->fpUnpack(fa_lun[spDB->iLun].row,
+														fa_lun[spDB->iLun].bmUnpack);
 			while (i < iCols)						// Step through each column in his row
 			  {
 				if (iAction & FA_COUNT)				// counts don't return original table/column names
@@ -127,9 +255,15 @@ int fa_sql_handler(	const int iAction,
 						sqlite3_column_int(fa_lun[spDB->iLun].row, i);
 
 				else if (spSQLcol->bmFlag & FA_COL_CHAR_B0)		// unpack a char/byte column?
-					memcpy(	spSQLcol->cpPos,
-							(char *) sqlite3_column_blob(fa_lun[spDB->iLun].row, i),
-							FA_FIELD_CHAR_S0);					// copy char with no trailing null
+				  {
+					char *cp = (char *) sqlite3_column_blob(fa_lun[spDB->iLun].row, i);
+					if (cp == 0)								// NULL, i.e. no matching row to a LEFT JOIN
+						*spSQLcol->cpPos=0;
+					else
+						memcpy(	spSQLcol->cpPos,
+								cp,
+								FA_FIELD_CHAR_S0);				// copy char with no trailing null
+				  }
 
 				else											// or a string/blob column?
 				  {
@@ -157,11 +291,12 @@ int fa_sql_handler(	const int iAction,
 	else if (iAction & FA_PREPARE)					// Prepare a custom statement ready for FA_STEP'ing
 	  {
 		ut_debug("fa_prepare: %s", cSQL);
-		ios=sqlite3_prepare_v2(	fa_lun[spDB->iLun].db,		// database handle
+		while ((ios=sqlite3_prepare_v2(	fa_lun[spDB->iLun].db,		// database handle
 								cSQL,				// SQL statement to prepare (compile)
 								-1,					// Length of SQL command or up to 1st null if -1
 								&fa_lun[spDB->iLun].row,	// handle for prepared statement
-								0);					// pointer to unused statement (after null) if not null
+								0)) == SQLITE_BUSY &&	// pointer to unused statement (after null) if not null
+				fa_sql_retry(spDB->iLun, iRetry++, 1));		// always safe to retry a prepare
 		ut_check(ios == SQLITE_OK, "prepare: %d", ios);
 	  }
 
@@ -174,16 +309,88 @@ int fa_sql_handler(	const int iAction,
     else if (iAction & FA_EXEC)					// Execute a custom SQL statement as a one-off
 	  {											//		with no callback routine
 		ut_debug("fa_exec: %s", cSQL);
-		ios=sqlite3_exec(	fa_lun[spDB->iLun].db,		// database handle
-							cSQL,				// SQL command to prepare-step-finalise
-							0,					// callback function - if not null
-							0,					// 1st argument for callback function
-							0);					// null terminated error message string or 0 if ok
+		do
+		  {
+			iChanges=sqlite3_total_changes(fa_lun[spDB->iLun].db);
+			ios=sqlite3_exec(	fa_lun[spDB->iLun].db,		// database handle
+								cSQL,				// SQL command to prepare-step-finalise
+								0,					// callback function - if not null
+								0,					// 1st argument for callback function
+								0);					// null terminated error message string or 0 if ok
+		  }										// retry if nothing done yet outside a transaction, or a COMMIT
+		while (ios == SQLITE_BUSY &&
+				fa_sql_retry(spDB->iLun, iRetry++,
+					(sqlite3_get_autocommit(fa_lun[spDB->iLun].db) &&
+						iChanges == sqlite3_total_changes(fa_lun[spDB->iLun].db)) ||
+					strncasecmp(cSQL, "COMMIT", 6) == 0 || strncasecmp(cSQL, "END", 3) == 0));
 		ut_check(ios == SQLITE_OK, "exec: %d", ios);
 	  }
 
+    else if (iAction & FA_WRITE)				// INSERT using a specialised function generated by fa_schema_gen
+	  {
+		spSQLtable=spDB->spTab;
+		while (spSQLtable->bmField == 0)			// same table as the SQL generator would use
+		  {
+			spSQLtable++;
+			ut_check(++i < spDB->iTab, "no fields");
+		  }
+		ut_debug("fa_write: %s", spSQLtable->sName);
+		if (fa_lun[spDB->iLun].spWrite == 0 ||		// re-use the last INSERT if for the same columns
+			fa_lun[spDB->iLun].spWriteTab != spSQLtable || fa_lun[spDB->iLun].bmWrite != spSQLtable->bmField)
+		  {
+			ios=fa_sql_write_prepare(spDB->iLun, spSQLtable);
+			ut_check(ios == SQLITE_OK, "write prepare: %d", ios);
+		  }
+
+		ios=spSQLtable->fpWrite(fa_lun[spDB->iLun].spWrite,	// bind this row's values
+								spSQLtable->bmField);		// columns to INSERT
+		ut_check(ios == SQLITE_OK, "write bind: %d", ios);
+
+		while ((ios=sqlite3_step(fa_lun[spDB->iLun].spWrite)) == SQLITE_BUSY &&
+				fa_sql_retry(spDB->iLun, iRetry++, sqlite3_get_autocommit(fa_lun[spDB->iLun].db)));
+		sqlite3_reset(fa_lun[spDB->iLun].spWrite);	// ready for the next row
+		ut_check(ios == SQLITE_DONE, "write: %d", ios);
+		ios=SQLITE_OK;
+	  }
+
+    else if (iAction & FA_BATCH)				// Load keys for an FA_READ+FA_BATCH into the temp key table
+	  {											//		private to this connection so no locks
+		spBatch=(struct fa_sql_batch *) cSQL;
+		ut_debug("fa_batch: %d keys", spBatch->iKeys);
+		ios=sqlite3_exec(	fa_lun[spDB->iLun].db,
+							"CREATE TEMP TABLE IF NOT EXISTS fa_batch(n INTEGER PRIMARY KEY, v);"
+							"SAVEPOINT fa_batch; DELETE FROM temp.fa_batch;",	// one transaction for all the keys
+							0, 0, 0);
+		ut_check(ios == SQLITE_OK, "batch: %d", ios);
+
+		ios=sqlite3_prepare_v2(fa_lun[spDB->iLun].db, "INSERT INTO temp.fa_batch VALUES(?, ?);", -1, &spIns, 0);
+		for (i=0; ios == SQLITE_OK && i < spBatch->iKeys; i++)	// re-use the INSERT for each key
+		  {
+			sqlite3_bind_int(spIns, 1, i);
+			if (spBatch->iSize == 0)
+				sqlite3_bind_int(spIns, 2, ((int *) spBatch->vpKeys)[i]);
+			else
+			  {
+				char *cp = (char *) spBatch->vpKeys+i*spBatch->iSize;
+				sqlite3_bind_text(spIns, 2, cp, strnlen(cp, spBatch->iSize), SQLITE_STATIC);
+			  }
+			if ((ios=sqlite3_step(spIns)) == SQLITE_DONE) ios=sqlite3_reset(spIns);
+		  }
+		sqlite3_finalize(spIns);
+
+		if (ios != SQLITE_OK)
+			sqlite3_exec(fa_lun[spDB->iLun].db, "ROLLBACK TO fa_batch;", 0, 0, 0);
+		sqlite3_exec(fa_lun[spDB->iLun].db, "RELEASE fa_batch;", 0, 0, 0);
+		ut_check(ios == SQLITE_OK, "batch key: %d", ios);
+	  }
+
     else if (iAction & FA_CLOSE)				// Close database
 	  {
+		fa_sql_feed(FA_CLOSE, spDB, 0, 0);		// drop any change feed and its statement
+		fa_sql_checkpoint(FA_CLOSE, spDB);		// stop any checkpoint scheduler and its connection
+		sqlite3_finalize(fa_lun[spDB->iLun].spWrite);	// and any re-used INSERT
+		fa_lun[spDB->iLun].spWrite=0;
+
 	    if (spDB->iLun > 0)						// check db is open
 			if (fa_lun[spDB->iLun].db > 0)
 				sqlite3_close(fa_lun[spDB->iLun].db);
@@ -194,6 +401,10 @@ int fa_sql_handler(	const int iAction,
 		ios=-1;										// Unknown command passed?
 	  }
 
+	if (!(iAction & FA_CLOSE))
+		fa_sql_feed_flush(spDB->iLun);				// deliver any committed changes to subscribers
+	if (spDB->spCkpt != 0)							// idle time counts from the end of the call
+		__atomic_store_n(&fa_lun[spDB->iLun].lActive, fa_sql_us(&sZero), __ATOMIC_RELAXED);
 	return ios;
 
 error:
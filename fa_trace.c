@@ -0,0 +1,133 @@
+//--------------------------------------------------------------
+//
+// Capture a workload trace of fa_handler calls for replaying with fa_replay
+//
+//	usage:	status = fa_trace(action, file)
+//		where	action is FA_OPEN to start capturing to the named trace file or FA_CLOSE to stop
+//				file points to a string containing the trace file name
+//		returns 0 if ok, else -1
+//
+//		fa_handler(FA_INIT, DB, file) also starts capturing if passed a file name
+//
+//			fa_trace_record (action, lun, status, SQL, start)
+//		is called by fa_handler, when capturing, as each call completes. Recording the action, lun, status,
+//			any SQL script (including selected field values) and timings. See fa_trace.h for the file format.
+//			Specialised INSERTs are recorded as run, with their bound values.
+//
+//			script = fa_trace_batch (batch, SQL)
+//		returns an FA_READ+FA_BATCH's SELECT preceded by a script to load its keys into temp.fa_batch, so it
+//			can be replayed, or 0 if out of memory. Free with sqlite3_free.
+//
+//		Capture may be started and stopped while other threads are recording calls. Records hold a read
+//			lock on the trace file so it is only closed once no thread is writing to it.
+//
+//	GNU GPLv3 licence	libgxtfa by Andrew Bennington 2017 [www.benningtons.net]
+//
+//--------------------------------------------------------------
+
+#include <pthread.h>		// thread ids and capture lock
+#include <sqlite3.h>		// sqlite3_str for building batch key scripts
+#include <stdio.h>			// standard I/O
+#include <string.h>			// string functions such as strlen
+#include <time.h>			// clock_gettime for timings
+#include <unistd.h>			// getpid
+
+#include <fa_def.h>			// file/db actions
+#include <fa_sql_def.h>		// struct fa_sql_batch
+#include <fa_trace.h>		// trace file format
+#include <ut_error.h>		// error handling and debug functions
+
+FILE *fa_trace_fp = 0;					// trace file, or 0 if not capturing
+static struct timespec sTraceStart;		// when capturing started
+static pthread_rwlock_t sTraceLock = PTHREAD_RWLOCK_INITIALIZER;	// write locked to start/stop capture
+
+
+int fa_trace(const int iAction, char *cpFile)
+  {
+	struct fa_trace_header sHead;
+	FILE *fp = 0;
+
+	pthread_rwlock_wrlock(&sTraceLock);	// wait for any records being written
+	if (fa_trace_fp != 0)				// stop any current capture
+	  {
+		fclose(fa_trace_fp);
+		__atomic_store_n(&fa_trace_fp, 0, __ATOMIC_RELEASE);
+	  }
+
+	if (iAction & FA_OPEN)
+	  {
+		fp=fopen(cpFile, "w");
+		ut_check(fp != 0, "trace open: %s", cpFile);
+
+		memcpy(sHead.sMagic, FA_TRACE_MAGIC, 4);
+		sHead.iPid=getpid();
+		sHead.lStart=time(0);
+		ut_check(fwrite(&sHead, sizeof(sHead), 1, fp) == 1, "trace write: %s", cpFile);
+
+		clock_gettime(CLOCK_MONOTONIC, &sTraceStart);
+		__atomic_store_n(&fa_trace_fp, fp, __ATOMIC_RELEASE);
+		ut_log("tracing to %s", cpFile);
+	  }
+
+	pthread_rwlock_unlock(&sTraceLock);
+	return 0;
+
+error:
+	if (fp != 0) fclose(fp);
+	pthread_rwlock_unlock(&sTraceLock);
+	return -1;
+  }
+
+
+void fa_trace_record(int iAction, int iLun, int iStatus, char *cpSQL, struct timespec *spStart)
+  {
+	struct fa_trace_record sRec;
+	struct timespec sEnd;
+	FILE *fp;
+
+	clock_gettime(CLOCK_MONOTONIC, &sEnd);
+
+	sRec.iAction=iAction;
+	sRec.iLun=iLun;
+	sRec.iStatus=iStatus;
+	sRec.iLen=(cpSQL == 0) ? 0 : strlen(cpSQL);
+	sRec.lThread=(unsigned long long) pthread_self();
+	sRec.lStart=(spStart->tv_sec-sTraceStart.tv_sec)*1000000000LL+spStart->tv_nsec-sTraceStart.tv_nsec;
+	sRec.lTime=(sEnd.tv_sec-spStart->tv_sec)*1000000000LL+sEnd.tv_nsec-spStart->tv_nsec;
+
+	pthread_rwlock_rdlock(&sTraceLock);	// stop the file being closed while in use
+	if ((fp=fa_trace_fp) != 0)			// still capturing?
+	  {
+		flockfile(fp);					// keep each record and its SQL together
+		fwrite(&sRec, sizeof(sRec), 1, fp);
+		if (sRec.iLen > 0) fwrite(cpSQL, 1, sRec.iLen, fp);
+		funlockfile(fp);
+	  }
+	pthread_rwlock_unlock(&sTraceLock);
+  }
+
+
+char *fa_trace_batch(struct fa_sql_batch *spBatch, char *cpSQL)
+  {
+	sqlite3_str *spStr = sqlite3_str_new(0);
+	char *cpKey;
+	int i;
+
+	sqlite3_str_appendall(spStr, "CREATE TEMP TABLE IF NOT EXISTS fa_batch(n INTEGER PRIMARY KEY, v); "
+								"DELETE FROM temp.fa_batch; ");
+	for (i=0; i < spBatch->iKeys; i++)
+	  {
+		sqlite3_str_appendall(spStr, (i == 0) ? "INSERT INTO temp.fa_batch VALUES " : ", ");
+		if (spBatch->iSize == 0)
+			sqlite3_str_appendf(spStr, "(%d, %d)", i, ((int *) spBatch->vpKeys)[i]);
+		else
+		  {
+			cpKey=(char *) spBatch->vpKeys+i*spBatch->iSize;
+			sqlite3_str_appendf(spStr, "(%d, %.*Q)", i, (int) strnlen(cpKey, spBatch->iSize), cpKey);
+		  }
+	  }
+	if (spBatch->iKeys > 0) sqlite3_str_appendall(spStr, "; ");
+	sqlite3_str_appendall(spStr, cpSQL);
+
+	return sqlite3_str_finish(spStr);
+  }
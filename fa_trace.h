@@ -0,0 +1,48 @@
+//--------------------------------------------------------------
+//
+// Format of fa_handler workload trace files - written by fa_trace and replayed by fa_replay
+//
+// A trace file starts with a header then holds one record per fa_handler call, each followed by any
+//	SQL script (or file name) the call used. SQL scripts include the values of any selected fields.
+//	FA_READ+FA_BATCH calls' scripts first load their keys into temp.fa_batch, then SELECT.
+//	Records are written in native byte order so traces should be replayed on the same architecture.
+//
+//	GNU GPLv3 licence	libgxtfa by Andrew Bennington 2017 [www.benningtons.net]
+//
+//--------------------------------------------------------------
+
+#ifndef __FA_TRACE_INCLUDED__
+#define __FA_TRACE_INCLUDED__
+
+#include <stdio.h>
+#include <time.h>
+
+#include <fa_sql_def.h>
+
+#define	FA_TRACE_MAGIC		"FAT1"		// Identifies trace files
+
+struct fa_trace_header					// start of each trace file
+  {
+	char		sMagic[4];				// FA_TRACE_MAGIC
+	int			iPid;					// process traced
+	long long	lStart;					// wall clock time trace started (seconds since epoch)
+  };
+
+struct fa_trace_record					// one per fa_handler call
+  {
+	unsigned int		iAction;		// fa_handler action bits - including any FA_KEYx
+	int					iLun;			// lun used or -1
+	int					iStatus;		// status returned by fa_handler
+	unsigned int		iLen;			// length of SQL script following this record - no null terminator
+	unsigned long long	lThread;		// calling thread
+	unsigned long long	lStart;			// nanoseconds from start of trace to start of call
+	unsigned long long	lTime;			// nanoseconds spent in call
+  };
+
+extern FILE *fa_trace_fp;				// trace file, or 0 if not capturing
+
+int fa_trace(const int, char*);											// start/stop capturing
+void fa_trace_record(int, int, int, char*, struct timespec*);			// record an fa_handler call
+char *fa_trace_batch(struct fa_sql_batch*, char*);						// script to replay a batched read
+
+#endif